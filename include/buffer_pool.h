@@ -0,0 +1,76 @@
+//
+// USB Power Delivery Sink Using FUSB302B
+// Copyright (c) 2020 Manuel Bleichenbacher
+//
+// Licensed under MIT License
+// https://opensource.org/licenses/MIT
+//
+// Pool of fixed-size buffers
+//
+
+#pragma once
+
+#include <stdint.h>
+
+namespace usb_pd {
+
+/**
+ * Pool of N buffers of LEN bytes each.
+ *
+ * Buffers are leased and must be released when no longer needed.
+ * If all buffers are leased, no further buffer can be leased until
+ * one has been released.
+ *
+ * The pool is not interrupt safe.
+ *
+ * RAM use is N × LEN bytes plus a 16-bit mask of the leased buffers
+ * (2 bytes, padded to the alignment of the containing struct).
+ */
+template <int LEN, int N> struct buffer_pool {
+    static_assert(N > 0 && N <= 16, "buffer pool supports 1 to 16 buffers");
+
+    /// Leases a buffer; returns `nullptr` if all buffers are leased
+    uint8_t* lease();
+
+    /// Releases a leased buffer
+    void release(const uint8_t* buf);
+
+    /// Releases all buffers
+    void reset() { leased = 0; }
+
+    /// Returns the number of buffers that are not leased
+    int num_free();
+
+  private:
+    /// Bit mask of leased buffers (bit 0: first buffer)
+    uint16_t leased = 0;
+
+    uint8_t buffers[N][LEN];
+};
+
+template <int LEN, int N> uint8_t* buffer_pool<LEN, N>::lease() {
+    for (int i = 0; i < N; i++) {
+        if ((leased & (1 << i)) == 0) {
+            leased |= 1 << i;
+            return buffers[i];
+        }
+    }
+
+    return nullptr;
+}
+
+template <int LEN, int N> void buffer_pool<LEN, N>::release(const uint8_t* buf) {
+    int index = (buf - buffers[0]) / LEN;
+    leased &= ~(1 << index);
+}
+
+template <int LEN, int N> int buffer_pool<LEN, N>::num_free() {
+    int n = 0;
+    for (int i = 0; i < N; i++) {
+        if ((leased & (1 << i)) == 0)
+            n++;
+    }
+    return n;
+}
+
+} // namespace usb_pd
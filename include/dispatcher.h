@@ -0,0 +1,84 @@
+//
+// USB Power Delivery Sink Using FUSB302B
+// Copyright (c) 2020 Manuel Bleichenbacher
+//
+// Licensed under MIT License
+// https://opensource.org/licenses/MIT
+//
+// Event flag dispatcher for the main loop
+//
+
+#pragma once
+
+#include <stdint.h>
+
+namespace usb_pd {
+
+/// Subsystem run by the main loop (in order of priority, highest first)
+enum class subsystem {
+    /// USB PD controller and sink (FUSB302 interrupt, protocol timers)
+    pd_ctrl,
+    /// Software timers (incl. LED flashing)
+    timer,
+    /// Button
+    button,
+    /// Debug output (I2C recording)
+    debug_output,
+    /// Number of subsystems
+    count
+};
+
+/// Function doing the pending work of a subsystem
+typedef void (*work_handler)(void* context);
+
+/**
+ * Run-to-completion dispatcher.
+ *
+ * Interrupt handlers and other subsystems signal that a subsystem has
+ * pending work by setting its event flag. The main loop then runs the
+ * handlers of the flagged subsystems, one at a time and always the one
+ * with the highest priority first. Thus, pending PD work is done before
+ * the LED and the button are updated.
+ */
+struct event_dispatcher {
+    /**
+     * Sets the handler for a subsystem.
+     *
+     * @param sub subsystem
+     * @param handler function doing the pending work
+     * @param context context passed to the handler
+     */
+    void set_handler(subsystem sub, work_handler handler, void* context = nullptr);
+
+    /**
+     * Signals that a subsystem has pending work.
+     *
+     * Can be called from interrupt handlers.
+     *
+     * @param sub subsystem
+     */
+    void signal(subsystem sub);
+
+    /// Runs the handlers of all subsystems with pending work (in order of priority)
+    void run();
+
+    /// Indicates if any subsystem has pending work
+    bool has_pending_work() { return pending != 0; }
+
+    /// Gets the number of times the handler of a subsystem has been run
+    uint32_t dispatch_count(subsystem sub) { return dispatch_counts[static_cast<int>(sub)]; }
+
+  private:
+    constexpr static int num_subsystems = static_cast<int>(subsystem::count);
+
+    /// Bit mask of subsystems with pending work (bit 0: highest priority)
+    volatile uint32_t pending = 0;
+
+    work_handler handlers[num_subsystems] = {};
+    void* contexts[num_subsystems] = {};
+    uint32_t dispatch_counts[num_subsystems] = {};
+};
+
+extern event_dispatcher dispatcher;
+
+} // namespace usb_pd
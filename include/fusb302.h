@@ -11,6 +11,7 @@
 
 #pragma once
 
+#include "buffer_pool.h"
 #include "fusb302_regs.h"
 #include "hal.h"
 #include "queue.h"
@@ -30,11 +31,31 @@ enum class fusb302_state {
     usb_retry_wait
 };
 
+/// Type-C connection state (of a sink)
+enum class typec_state {
+    /// No source attached (Unattached.SNK)
+    unattached,
+    /// Source detected on CC1/CC2, waiting for stable CC and VBUS (AttachWait.SNK)
+    attach_wait,
+    /// Source attached and VBUS present (Attached.SNK)
+    attached
+};
+
 /// Event kind
 enum class event_kind {
     none,
     state_changed,
-    message_received
+    message_received,
+    /// Source has been attached (Type-C connection state has changed to `attached`)
+    attached,
+    /// Source has been detached (not reported for the resets of a retry cycle if the source is still present)
+    detached,
+    /// Hard reset has been received or sent (protocol state changes to `usb_pd_wait`)
+    hard_reset,
+    /// Message has been sent and acknowledged with GoodCRC (header incl. message ID in `msg_header`)
+    tx_sent,
+    /// Message could not be sent or was not acknowledged (header incl. message ID in `msg_header`)
+    tx_failed
 };
 
 /// Event queue by FUSB302 instance for clients (such as `pd_sink`)
@@ -42,7 +63,7 @@ struct event {
     /// Event kind
     event_kind kind;
 
-    /// Message header (valid if event_kind = `message_received`)
+    /// Message header (valid if event_kind = `message_received`, `tx_sent` or `tx_failed`)
     uint16_t msg_header;
 
     /// Message payload (valid if event_kind = `message_received`, possibly `null`)
@@ -54,6 +75,99 @@ struct event {
 
     event(uint16_t header, const uint8_t* payload = nullptr)
         : kind(event_kind::message_received), msg_header(header), msg_payload(payload) {}
+
+    event(event_kind evt_kind, uint16_t header) : kind(evt_kind), msg_header(header), msg_payload(nullptr) {}
+};
+
+/// Snapshot of the consecutive FUSB302 registers STATUS0A to INTERRUPT
+struct fusb302_status {
+    uint8_t status0a;
+    uint8_t status1a;
+    uint8_t interrupta;
+    uint8_t interruptb;
+    uint8_t status0;
+    uint8_t status1;
+    uint8_t interrupt;
+};
+
+static_assert(sizeof(fusb302_status) == reg_interrupt - reg_status0a + 1, "fusb302_status must match register layout");
+
+/// Statistics about configuration register writes
+struct fusb302_write_stats {
+    /// Number of registers written to the FUSB302
+    uint32_t regs_written;
+    /// Number of register writes skipped as the register already had the value
+    uint32_t regs_elided;
+    /// Number of I2C write transactions for configuration registers
+    uint32_t transactions;
+};
+
+/// Statistics about received messages
+struct fusb302_rx_stats {
+    /// Number of messages read from the RX FIFO
+    uint32_t messages;
+    /// Number of messages discarded (invalid token or CRC, not incl. I2C errors)
+    uint32_t invalid_messages;
+    /// Number of I2C transactions used for reading messages (incl. FIFO status)
+    uint32_t transactions;
+    /// Number of times a message could not be read as all RX buffers were in use
+    uint32_t buffer_exhaustions;
+};
+
+/**
+ * Statistics about the CRC check of received messages.
+ *
+ * The BMC receiver threshold and hysteresis (SLICE register) are calibrated
+ * per connection: settings are tried in turn until one receives a window of
+ * messages without CRC failures (or the best one is chosen after all have
+ * been tried). The setting is kept until the source is detached.
+ */
+struct fusb302_crc_stats {
+    /// Number of messages checked
+    uint32_t messages;
+    /// Number of messages with invalid CRC
+    uint32_t crc_failures;
+    /// Number of times the SLICE setting has been changed
+    uint32_t slice_changes;
+    /// Current SLICE register value
+    uint8_t slice;
+    /// Indicates if the calibration of the SLICE setting is complete
+    bool is_calibrated;
+};
+
+/**
+ * Policy for the timeouts when establishing USB PD communication.
+ *
+ * The wait time for the first USB PD message is doubled after each timeout
+ * (for sources slow to send their capabilities). The wait time after a
+ * failure is doubled for each consecutive failure (e.g. repeated hard resets).
+ * Both are limited to the maximum and reset when a source is detached.
+ */
+struct fusb302_retry_policy {
+    /// Initial time to wait for the first USB PD message after attachment (in ms)
+    uint32_t pd_wait_ms = 300;
+    /// Maximum time to wait for the first USB PD message (in ms)
+    uint32_t max_pd_wait_ms = 1200;
+    /// Time to wait after the first failure before monitoring CC1/CC2 again (in ms)
+    uint32_t retry_wait_ms = 300;
+    /// Maximum time to wait after repeated failures (in ms)
+    uint32_t max_retry_wait_ms = 2000;
+};
+
+/// Statistics about establishing USB PD communication
+struct fusb302_retry_stats {
+    /// Number of times no USB PD message was received in time
+    uint32_t pd_wait_timeouts;
+    /// Number of hard resets
+    uint32_t hard_resets;
+    /// Number of retry waits
+    uint32_t retries;
+    /// Total time spent waiting for the first USB PD message (in ms)
+    uint32_t pd_wait_time_ms;
+    /// Total time spent waiting after failures (in ms)
+    uint32_t retry_wait_time_ms;
+    /// Time from the first detection of CC activity to USB PD communication (last time, in ms)
+    uint32_t last_time_to_pd_ms;
 };
 
 /**
@@ -67,8 +181,22 @@ struct event {
  *
  * Internally, a short queue is used to store the events until they have been
  * consumed.
+ *
+ * With the build flag `PD_ISR_RX`, the interrupt registers are read and the
+ * RX FIFO is drained by the INT_N interrupt handler. The received messages
+ * are buffered until `poll()` processes them.
  */
 struct fusb302 {
+    /**
+     * Creates a new instance.
+     *
+     * @param port index of the PD controller (see `mcu_hal::num_pd_ctrls()`)
+     */
+    fusb302(int port = 0) : port_(port) {}
+
+    /// Gets the index of the PD controller
+    int port() { return port_; }
+
     /**
      * Gets the device ID.
      * @param device_id_buf buffer receiving device ID string (at least 24 bytes long)
@@ -84,6 +212,10 @@ struct fusb302 {
      * It will enable the pull-down resistors and monitor CC1 and CC2 for USB-PD
      * communication. Once a source has connected, the appropriate CC line will
      * be configured for communication.
+     *
+     * By default, CC1 and CC2 are measured alternately every 10ms. With the
+     * build flag `PD_HW_TOGGLE`, the FUSB302B's autonomous sink polling is used
+     * instead and the MCU is woken by the toggle done interrupt.
      */
     void start_sink();
 
@@ -94,12 +226,33 @@ struct fusb302 {
      */
     void poll();
 
+    /**
+     * Reads the status and interrupt registers in a single transaction.
+     *
+     * Reading the registers clears the pending interrupts.
+     *
+     * @param status receives the register values
+     * @return `true` if successful, `false` if an I2C error occurred
+     */
+    bool read_status(fusb302_status& status);
+
     /// Gets the current protocol state.
     fusb302_state state() { return state_; }
 
+    /// Gets the current Type-C connection state.
+    typec_state connection() { return typec_state_; }
+
+    /// Sets the policy for the timeouts when establishing USB PD communication
+    void set_retry_policy(const fusb302_retry_policy& policy);
+
+    /// Gets the statistics about establishing USB PD communication
+    fusb302_retry_stats retry_stats() { return retry_stats_; }
+
     /**
      * Sends a message with the given header and payload.
      * The message ID is automatically inserted into the header.
+     *
+     * The outcome is reported with a `tx_sent` or `tx_failed` event.
      */
     void send_message(uint16_t header, const uint8_t* payload);
 
@@ -109,66 +262,344 @@ struct fusb302 {
      */
     void send_header_message(pd_msg_type msg_type);
 
+    /**
+     * Sends a hard reset.
+     *
+     * Once it has been sent, the protocol is reset as for a received hard reset.
+     */
+    void send_hard_reset();
+
+    /**
+     * Resets the protocol layer (message ID, TX FIFO) after a soft reset.
+     *
+     * The CC configuration and the protocol state are not changed.
+     */
+    void reset_protocol();
+
+    /// Gets the statistics about configuration register writes
+    fusb302_write_stats write_stats() { return write_stats_; }
+
+    /// Gets the statistics about received messages
+    fusb302_rx_stats rx_stats() { return rx_stats_; }
+
+    /// Gets the statistics about the CRC check of received messages
+    fusb302_crc_stats crc_stats() { return crc_stats_; }
+
+    /// Gets the total number of I2C transactions
+#if defined(PD_ISR_RX)
+    uint32_t transactions() { return num_transactions + isr_transactions; }
+#else
+    uint32_t transactions() { return num_transactions; }
+#endif
+
+    /**
+     * Gets the number of I2C transactions that failed even after retrying.
+     *
+     * Such bus errors are handled by repeating the operation later and
+     * do not reset the USB PD communication unless they persist.
+     */
+    uint32_t bus_errors() { return bus_errors_; }
+
     /// Indicates if an event is available.
     bool has_event();
 
-    /// Retrieves the oldest event and removes it from the queue
+    /**
+     * Retrieves the oldest event and removes it from the queue.
+     *
+     * The payload of a received message remains valid until the next call.
+     */
     event pop_event();
 
+#if defined(PD_ISR_RX)
+    /// Reads the interrupt registers and drains the RX FIFO (called in interrupt context)
+    void on_int_n();
+#endif
+
   private:
+    /// Index of the PD controller
+    int port_;
+
     void check_for_interrupts();
-    void check_for_msg();
+    /// Handles the interrupts; returns `false` if received messages are to be discarded
+    bool handle_interrupts(const fusb302_status& status);
+    void check_for_msg(uint8_t status1);
+    /// Adds a message event (or releases the leased payload buffer if the message is not delivered)
+    void deliver_message(uint16_t header, uint8_t* payload, bool is_crc_valid);
     void start_measurement(int cc);
     void check_measurement();
+#if defined(PD_HW_TOGGLE)
+    void start_toggling();
+    void check_toggle_result(uint8_t status1a);
+#endif
     void establish_usb_20();
     void establish_usb_pd_wait(int cc);
     void establish_usb_pd();
     void establish_retry_wait();
-
+    void establish_unattached();
+    void establish_hard_reset_recovery();
+
+    /// Reports the outcome of the pending message transmission
+    void on_tx_completed(event_kind kind);
+
+    /// Updates the CRC statistics and calibrates the SLICE setting
+    void calibrate_slice(bool is_crc_valid);
+    /// Restarts the SLICE calibration with the default setting
+    void reset_slice_calibration();
+
+    /// Sets the protocol state and accounts the time spent in the previous state
+    void set_state(fusb302_state state);
+    /// Resets the adapted timeouts to the initial values of the retry policy
+    void reset_retry_timeouts();
+
+    /// Sets the Type-C connection state and notifies about attach and detach
+    void set_typec_state(typec_state state);
+    /// Notifies about attach or detach unless it has already been reported
+    void report_attached(bool attached);
+    /// Updates the Type-C connection state after a VBUS or CC change
+    void on_typec_change(uint8_t interrupt, uint8_t status0);
+    static void on_cc_debounce_timer(void* context);
+    /// Checks CC and VBUS after the CC debounce time
+    void check_cc_debounced();
+
+    static void on_timeout_timer(void* context);
     /// Checks if the timeout has expired
     bool has_timeout_expired();
     /// Starts a new timeout (and cancels the pending one)
     void start_timeout(uint32_t ms);
     /// Cancels the pending timeout (if any)
     void cancel_timeout();
+    /// Indicates if `poll()` has further work to do
+    bool has_pending_work();
 
-    /// Retrieves the received message from the FIFO into the specified variables.
-    uint8_t read_message(uint16_t& header, uint8_t* payload);
+    /**
+     * Retrieves the received message from the FIFO into the specified variables.
+     *
+     * @return `true` if a message has been read, `false` if the FIFO did not start
+     *   with a SOP token or the message could not be read completely (the FIFO is
+     *   flushed in this case) or if an I2C error occurred (`has_pending_rx` is set).
+     *   Only a missing SOP token counts as invalid message; I2C errors are counted
+     *   as bus errors (see `check_bus_result()`).
+     */
+    bool read_message(uint16_t& header, uint8_t* payload);
 
-    /// Reads the value of the specified register.
+    /// Reads the value of the specified register (0 if an I2C error occurred).
     uint8_t read_register(reg r);
 
-    /// Reads the values of several consecutive registers.
-    void read_registers(reg start_addr, int n, uint8_t* target);
+    /// Reads the values of several consecutive registers; returns `false` if an I2C error occurred.
+    bool read_registers(reg start_addr, int n, uint8_t* target);
+
+    /// Write a value to the specified register (immediately and bypassing the shadow registers).
+    bool write_register(reg r, uint8_t value);
+
+    /**
+     * Writes a self-clearing command bit (e.g. TX_FLUSH) immediately.
+     *
+     * The other bits of the register are written with their shadow value
+     * so the register configuration is not changed.
+     */
+    bool write_command(reg r, uint8_t command);
+
+    /// Updates the bus error counters with the result of an I2C transaction and returns it.
+    bool check_bus_result(bool success);
+
+    /**
+     * Sets the value of a configuration register (SWITCHES0 to CONTROL4, except RESET).
+     *
+     * The value is stored in the shadow register and written by the next call of
+     * `flush_registers()` unless the register already has the value.
+     */
+    void set_register(reg r, uint8_t value);
+
+    /**
+     * Writes all modified shadow registers to the FUSB302, coalescing them into burst writes.
+     *
+     * @return `true` if successful, `false` if an I2C error occurred (the registers
+     *   not yet written remain modified)
+     */
+    bool flush_registers();
+
+    /// First register covered by the shadow registers
+    constexpr static reg shadow_first_reg = reg_switches0;
+
+    /// Number of shadow registers (SWITCHES0 to CONTROL4)
+    constexpr static int num_shadow_regs = reg_control4 - reg_switches0 + 1;
+
+    /// Maximum number of unmodified registers included in a burst write to join two runs
+    constexpr static int max_bridged_regs = 2;
+
+    /// Shadow copy of the configuration registers
+    uint8_t shadow_regs[num_shadow_regs];
+
+    /// Bit mask of modified shadow registers not yet written (bit 0: SWITCHES0)
+    uint16_t dirty_regs = 0;
+
+    /// Statistics about configuration register writes
+    fusb302_write_stats write_stats_ = {};
+
+    /// Statistics about received messages
+    fusb302_rx_stats rx_stats_ = {};
+
+    /// Statistics about the CRC check of received messages
+    fusb302_crc_stats crc_stats_ = {0, 0, 0, slice_sdac_hys_085mv | 0x20, false};
+
+    /// Number of messages to evaluate a SLICE setting
+    constexpr static int slice_window_len = 8;
+
+    /// Number of CRC failures after which a SLICE setting is abandoned early
+    constexpr static int slice_max_failures = 2;
+
+    /// Number of SLICE settings tried
+    constexpr static int num_slice_settings = 6;
+
+    /// Index of current SLICE setting
+    int slice_index = 0;
+
+    /// Indicates if the calibration of the SLICE setting is complete
+    bool is_slice_calibrated = false;
+
+    /// Number of messages received with the current SLICE setting (in current window)
+    uint8_t window_messages = 0;
+
+    /// Number of CRC failures with the current SLICE setting (in current window)
+    uint8_t window_failures = 0;
+
+    /// Number of CRC failures per SLICE setting (in its evaluation window)
+    uint8_t slice_failures[num_slice_settings];
 
-    /// Write a value to the specified register.
-    void write_register(reg r, uint8_t value);
+    /// Total number of I2C transactions
+    uint32_t num_transactions = 0;
+
+    /// Number of I2C transactions that failed even after retrying
+    uint32_t bus_errors_ = 0;
+
+    /// Number of consecutive failed I2C transactions
+    int consecutive_bus_errors = 0;
+
+    /// Number of consecutive failed I2C transactions after which the FUSB302 is reset
+    constexpr static int max_consecutive_bus_errors = 8;
+
+    /// Indicates if the RX FIFO needs to be checked again (after an I2C error)
+    bool has_pending_rx = false;
 
     /// cc line being measured
     int measuring_cc = 0;
 
-    /// Indicates if the timeout timer is running
-    bool is_timeout_active = false;
+    /// Timer for the protocol state timeouts
+    sw_timer timeout_timer{on_timeout_timer, this};
 
-    /// Time when the current timer expires
-    uint32_t timeout_expiration;
+    /// Indicates if the timeout has expired but has not been handled yet
+    bool is_timeout_expired = false;
 
-    constexpr static int num_message_buf = 4;
+    /// Size of RX buffer (7 data objects and CRC)
+    constexpr static int rx_buf_len = 32;
 
-    /// RX message buffers
-    uint8_t rx_message_buf[64][num_message_buf];
+    /// RX buffers (leased by messages until consumed)
+    buffer_pool<rx_buf_len, 4> rx_bufs;
 
-    /// Next RX message index
-    int rx_message_index = 0;
+    /// Payload of the message event consumed last (released with the next `pop_event()`)
+    const uint8_t* consumed_payload = nullptr;
 
     /// Queue of event that have occurred
-    queue<event, 6> events;
+    queue<event, 8> events;
+
+#if defined(PD_ISR_RX)
+    static void int_n_handler(void* context);
+    /// Processes the interrupts and messages captured by the INT_N handler
+    void check_for_isr_events();
+    /// Reads the messages from the RX FIFO into `isr_msgs` (interrupt context)
+    void drain_rx_fifo(uint8_t status1);
+
+    /// Message read from the RX FIFO by the INT_N handler
+    struct isr_rx_msg {
+        uint16_t header;
+        /// Indicates if the CRC check result is known
+        bool is_crc_checked;
+        /// Indicates if the CRC was valid
+        bool is_crc_valid;
+        /// Payload and CRC
+        uint8_t payload[32];
+    };
+
+    /// Messages read by the INT_N handler
+    queue<isr_rx_msg, 4> isr_msgs;
+
+    /// Status registers (latest) and interrupt registers (accumulated) read by the INT_N handler
+    fusb302_status isr_status;
+
+    /// Indicates if `isr_status` contains unprocessed interrupts
+    volatile bool has_isr_status = false;
+
+    /// Indicates if an I2C transaction of the INT_N handler has failed
+    volatile bool has_isr_bus_error = false;
+
+    /// Indicates if the INT_N handler needs to run again (I2C error or no free message buffer)
+    volatile bool is_isr_retry_needed = false;
+
+    /// Number of I2C transactions of the INT_N handler
+    volatile uint32_t isr_transactions = 0;
+
+    /// Number of frames with an invalid token discarded by the INT_N handler (not yet added to `rx_stats_`)
+    volatile uint32_t isr_invalid_messages = 0;
+#endif
 
     /// Current attachment state
     fusb302_state state_ = fusb302_state::usb_20;
 
     /// ID for next USB PD message
     uint16_t next_message_id = 0;
+
+    /// Indicates if a message has been sent and its outcome not yet reported
+    bool is_tx_pending = false;
+
+    /// Header (incl. message ID) of the last message sent
+    uint16_t tx_header = 0;
+
+    /// Policy for the timeouts when establishing USB PD communication
+    fusb302_retry_policy retry_policy;
+
+    /// Statistics about establishing USB PD communication
+    fusb302_retry_stats retry_stats_ = {};
+
+    /// Current (adapted) time to wait for the first USB PD message (in ms)
+    uint32_t pd_wait_ms = 300;
+
+    /// Number of consecutive failures (since USB PD communication was last established)
+    int num_failures = 0;
+
+    /// Time when the current protocol state was entered
+    uint32_t state_start_time = 0;
+
+    /// Time to wait for the source capabilities after a hard reset (in ms)
+    constexpr static uint32_t hard_reset_recovery_ms = 1500;
+
+    /// Indicates if a hard reset has been received and USB PD communication not yet re-established
+    bool is_recovering_from_hard_reset = false;
+
+    /// Indicates if CC activity has been detected but USB PD communication not yet established
+    bool is_attaching = false;
+
+    /// Time when CC activity was first detected
+    uint32_t attach_time = 0;
+
+    /// Current Type-C connection state
+    typec_state typec_state_ = typec_state::unattached;
+
+    /// Indicates if the last attach or detach event reported an attached source
+    bool is_attached_reported = false;
+
+#if defined(PD_HW_TOGGLE)
+    /// Time to wait for the toggle result before reporting a pending detach (in ms)
+    constexpr static uint32_t toggle_detach_ms = 200;
+#endif
+
+    /// CC debounce time tCCDebounce (in ms)
+    constexpr static uint32_t cc_debounce_ms = 100;
+
+    /// Timer for the CC debounce time
+    sw_timer cc_debounce_timer{on_cc_debounce_timer, this};
+
+    /// Indicates if the CC lines have been stable for the debounce time
+    bool is_cc_debounced = false;
 };
 
 } // namespace usb_pd
@@ -12,8 +12,13 @@
 
 #include <stdint.h>
 
+#include "timer_service.h"
+
 namespace usb_pd {
 
+struct i2c_profiler;
+struct i2c_recorder;
+
 enum class color {
     white = 0b000,
     yellow = 0b001,
@@ -25,6 +30,40 @@ enum class color {
     off = 0b111
 };
 
+/// LED color mixed from red, green and blue (intensities 0 to 255)
+struct rgb_color {
+    uint8_t red;
+    uint8_t green;
+    uint8_t blue;
+};
+
+#if defined(PD_ISR_RX)
+/// Handler called in interrupt context when the INT_N pin is asserted
+typedef void (*int_n_handler)(void* context);
+#endif
+
+#if defined(PD_CLOCK_SCALING)
+/// System clock speed
+enum class clock_speed {
+    /// 8 MHz (HSI), used when idle
+    low,
+    /// 48 MHz (HSI and PLL), used for communicating with the PD controller
+    high
+};
+#endif
+
+/// Statistics about I2C communication with the PD controller
+struct i2c_stats {
+    /// Number of failed I2C transactions (incl. the ones that succeeded when retried)
+    uint32_t errors;
+    /// Number of retried I2C transactions
+    uint32_t retries;
+    /// Number of bus recoveries
+    uint32_t recoveries;
+    /// Number of I2C transactions that failed even after retrying
+    uint32_t failures;
+};
+
 /**
  * Hardware abstraction layer.
  *
@@ -39,36 +78,111 @@ struct mcu_hal {
      */
     void init();
 
+    /**
+     * Gets the number of PD controllers (ports).
+     *
+     * PD controllers are identified by their index (0 to number - 1).
+     * They share the I2C bus but have different I2C addresses and INT_N pins.
+     */
+    int num_pd_ctrls();
+
     /**
      * Configures the INT_N pin as input (disabling SWD)
+     *
+     * @param port PD controller index
      */
-    void init_int_n();
+    void init_int_n(int port);
+
+    /**
+     * Enables the interrupt waking the MCU when the INT_N pin is asserted.
+     *
+     * The pin configuration is not changed. If it is still configured as
+     * SWDIO, SWD remains usable and the pin can still be read.
+     *
+     * @param port PD controller index
+     */
+    void enable_int_n_wakeup(int port);
+
+#if defined(PD_ISR_RX)
+    /**
+     * Sets the handler called from the INT_N interrupt.
+     *
+     * The handler may communicate with the PD controller. If the interrupt
+     * occurs while the main loop is in the middle of an I2C transaction, the
+     * handler is deferred until the transaction has completed.
+     *
+     * @param port PD controller index
+     * @param handler handler function
+     * @param context context passed to the handler
+     */
+    void set_int_n_handler(int port, int_n_handler handler, void* context);
+
+    /**
+     * Requests the INT_N handler to be run (in interrupt context)
+     * even though no edge has occurred on the INT_N pin.
+     *
+     * @param port PD controller index
+     */
+    void trigger_int_n_handler(int port);
+
+    /// Disables interrupts (to access data shared with interrupt handlers)
+    void disable_interrupts();
+
+    /// Enables interrupts again
+    void enable_interrupts();
+#endif
 
     /**
      * Read data from PD controller registers.
      *
+     * If the PD controller does not respond, the bus is recovered
+     * and the transaction is retried a limited number of times.
+     *
+     * @param port PD controller index
      * @param reg register address
      * @param data_len length of data to read (number of bytes)
      * @param data buffer for read data
+     * @return `true` if successful, `false` if the transaction failed even after retrying
      */
-    void pd_ctrl_read(uint8_t reg, int data_len, uint8_t* data);
+    bool pd_ctrl_read(int port, uint8_t reg, int data_len, uint8_t* data);
 
     /**
      * Write data to PD controller registers.
      *
+     * If the PD controller does not respond, the bus is recovered
+     * and the transaction is retried a limited number of times.
+     * Writes to the FIFO are not retried as part of the data might
+     * have been written.
+     *
+     * @param port PD controller index
      * @param reg register address
      * @param data_len length of data to write (number of bytes)
      * @param data buffer with data to be written
      * @param end_with_stop indicates if the I2C transaction should end with a STOP condition
+     * @return `true` if successful, `false` if the transaction failed even after retrying
      */
-    void pd_ctrl_write(uint8_t reg, int data_len, const uint8_t* data, bool end_with_stop = true);
+    bool pd_ctrl_write(int port, uint8_t reg, int data_len, const uint8_t* data, bool end_with_stop = true);
+
+    /// Gets the statistics about I2C communication with the PD controller
+    i2c_stats pd_ctrl_stats() { return i2c_stats_; }
+
+#if defined(PD_I2C_PROFILE)
+    /// Gets the profiler of the I2C communication with the PD controller
+    i2c_profiler& pd_ctrl_profiler();
+#endif
+
+#if defined(PD_I2C_RECORD)
+    /// Gets the recorder of the I2C communication with the PD controller
+    i2c_recorder& pd_ctrl_recorder();
+#endif
 
     /**
      * Gets if the interrupt pin is assert (low).
      *
+     * @param port PD controller index
      * @return `true` if the pin is asserted, `false` otherwise.
      */
-    bool is_interrupt_asserted();
+    bool is_interrupt_asserted(int port);
 
     /**
      * Sets the LED color and flash pattern.
@@ -82,6 +196,19 @@ struct mcu_hal {
      */
     void set_led(color c, uint32_t on = 0, uint32_t off = 0);
 
+    /**
+     * Sets the LED to a mixed color and flash pattern.
+     *
+     * Colors with full or zero intensity per channel flash with little
+     * involvement of the CPU. Dimmed colors are toggled by a timer.
+     * Red cannot be dimmed and is rounded to full on or off.
+     *
+     * @param c color
+     * @param on flash on duration (in ms)
+     * @param off flash off duration (in ms)
+     */
+    void set_led(rgb_color c, uint32_t on = 0, uint32_t off = 0);
+
     /**
      * Returns if the button has been pressed.
      *
@@ -111,20 +238,50 @@ struct mcu_hal {
      */
     bool is_long_press();
 
-    /**
-     * Call this function frequently to update the LED state
-     * and handle button presses.
-     */
-    void poll();
+    /// Checks for button changes (handler of the button subsystem)
+    void poll_button();
 
     /**
      * Sleep until an event occurs.
      * 
-     * In practice, it will sleep until a SYSTICK interrupt (once every ms)
-     * or an EXTI interrupt (on FUSB302 interrupt line) occurs.
+     * It sleeps until the next timer deadline (see `timer_service`) or
+     * until an interrupt (e.g. FUSB302 interrupt line or button) occurs.
+     * It returns immediately if a subsystem has pending work (see `event_dispatcher`).
+     * While sleeping, SysTick is stopped so the MCU is not woken every ms;
+     * the deadline is signaled by a TIM14 compare event (or the TIM14
+     * overflow every 65ms) and `millis()` is corrected afterwards.
+     *
+     * With the build flag `PD_STOP_MODE`, the MCU enters stop mode instead
+     * if the next timer deadline (see `timer_service`) is far enough away.
+     * It is woken by the RTC alarm shortly before the deadline, by the
+     * FUSB302 interrupt line or by the button. The time is corrected
+     * for the time spent in stop mode. Stop mode is first used about 4s
+     * after start-up, when the RTC clock (LSI) has been calibrated.
+     *
+     * With the build flag `PD_CLOCK_SCALING`, the system clock is reduced
+     * to 8 MHz before sleeping if there has been no PD controller activity
+     * for a while.
      */
     void wait_for_event();
 
+#if defined(PD_CLOCK_SCALING)
+    /**
+     * Changes the system clock speed.
+     *
+     * SysTick, the microsecond timer, the I2C timing and the debug UART
+     * are adapted to the new clock. Must not be called from interrupt handlers.
+     * The clock is automatically increased when the PD controller
+     * asserts INT_N (before its interrupt handler runs) or is accessed
+     * from the main loop, and reduced when idle.
+     *
+     * @param speed new clock speed
+     */
+    void set_clock_speed(clock_speed speed);
+
+    /// Gets the current system clock speed
+    clock_speed current_clock_speed() { return clock_speed_; }
+#endif
+
     /**
      * Returns time stamp.
      *
@@ -132,6 +289,24 @@ struct mcu_hal {
      */
     uint32_t millis();
 
+    /**
+     * Returns high-resolution time stamp.
+     *
+     * Derived from a free-running hardware timer. It does not wrap around.
+     * Can be called from interrupt handlers.
+     *
+     * @return number of microseconds since `init()` was called.
+     */
+    uint64_t micros();
+
+    /**
+     * Indicates if the caller is running in an interrupt handler.
+     *
+     * Code shared with the main loop uses it to skip work that is not
+     * safe in interrupt handlers (debug output, recording, clock changes).
+     */
+    bool is_in_interrupt_handler();
+
     /**
      * Sleep for the specified time
      *
@@ -147,16 +322,27 @@ struct mcu_hal {
     bool has_expired(uint32_t timeout);
 
   private:
+    static void on_led_timer(void* context);
+    void sleep_without_tick(uint64_t deadline, uint64_t now);
+#if defined(PD_STOP_MODE)
+    bool can_stop();
+    void stop(uint32_t duration_us);
+#endif
     void update_led();
+    bool recover_pd_ctrl_bus(int attempt, int max_retries);
 
-    color led_color;
+    rgb_color led_color;
     uint32_t led_on;
     uint32_t led_off;
     bool is_led_on;
-    uint32_t led_timeout;
+    sw_timer led_timer{on_led_timer, this};
     uint32_t last_button_change_time;
     bool is_button_down;
     bool button_has_been_pressed;
+    i2c_stats i2c_stats_;
+#if defined(PD_CLOCK_SCALING)
+    volatile clock_speed clock_speed_;
+#endif
 };
 
 extern mcu_hal hal;
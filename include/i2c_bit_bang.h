@@ -9,8 +9,13 @@
 
 #pragma once
 
+#include <stdint.h>
+
 #include <libopencm3/stm32/gpio.h>
 
+#include "i2c_bit_bang_timing.h"
+#include "i2c_config.h"
+
 namespace usb_pd {
 
 constexpr auto scl_port = GPIOA;
@@ -21,9 +26,15 @@ constexpr uint16_t sda_pin = GPIO9;
 struct i2c_bit_bang {
     void init();
 
+    /// Adapts the timing to the current system clock
+    void update_clock();
+
     bool write_data(uint8_t addr, uint8_t reg, int data_len, const uint8_t* data, bool end_with_stop = true);
     bool read_data(uint8_t addr, uint8_t reg, int data_len, uint8_t* data);
 
+    /// Frees a device holding SDA low by clocking it out, followed by a STOP condition
+    void recover_bus();
+
     void write_start_cond();
     void write_stop_cond();
     bool write_byte(uint8_t value);
@@ -33,11 +44,14 @@ struct i2c_bit_bang {
     bool read_bit();
 
     void delay();
-    void set_scl() { gpio_set(scl_port, scl_pin); }
-    void clear_scl() { gpio_clear(scl_port, scl_pin); }
-    void set_sda() { gpio_set(sda_port, sda_pin); }
-    void clear_sda() { gpio_clear(sda_port, sda_pin); }
-    bool read_sda() { return gpio_get(sda_port, sda_pin) != 0; }
+    void set_scl() { GPIO_BSRR(scl_port) = scl_pin; }
+    void clear_scl() { GPIO_BSRR(scl_port) = static_cast<uint32_t>(scl_pin) << 16; }
+    void set_sda() { GPIO_BSRR(sda_port) = sda_pin; }
+    void clear_sda() { GPIO_BSRR(sda_port) = static_cast<uint32_t>(sda_pin) << 16; }
+    bool read_sda() { return (GPIO_IDR(sda_port) & sda_pin) != 0; }
+
+    /// Number of delay loop iterations per SCL phase
+    uint32_t delay_loops = 1;
 
     bool is_started = false;
 };
@@ -0,0 +1,121 @@
+//
+// USB Power Delivery Sink Using FUSB302B
+// Copyright (c) 2020 Manuel Bleichenbacher
+//
+// Licensed under MIT License
+// https://opensource.org/licenses/MIT
+//
+// Timing model of I2C bit banging
+//
+
+#pragma once
+
+#include <stdint.h>
+
+namespace usb_pd {
+
+/**
+ * Timing model of the bit banging implementation.
+ *
+ * Each SCL phase (low and high) consists of the GPIO access and a delay
+ * loop. The model is a lower bound of the phase duration. The number of
+ * loop iterations is chosen such that even the lower bound is not shorter
+ * than half the SCL period of the requested speed. So the bus never runs
+ * faster than requested.
+ *
+ * The figures are taken from the Cortex-M0 instruction timings (ARM DDI 0432C,
+ * table 3-1) for the delay loop as assembled for ARMv6-M:
+ *
+ *     0: 01 38    subs  r0, #1     1 cycle
+ *     2: fd d1    bne   0          3 cycles if taken, 1 cycle if not taken
+ *
+ * A loop with n iterations takes 4n - 2 cycles. Outside the loop, each
+ * phase executes at least a STR to GPIO_BSRR (2 cycles) and a MOVS or MOV
+ * loading the loop counter (1 cycle). The compiled phases contain more
+ * instructions (e.g. selecting the SDA level or an LDR of the loop count).
+ * These only make the phase longer and are not part of the lower bound.
+ *
+ * Above 24MHz, the flash has 1 wait state (see `mcu_hal::set_clock_speed()`).
+ * The prefetch buffer covers sequential code only, and each taken branch
+ * refetches its target with up to 1 additional cycle. The wait states are
+ * therefore part of the expected SCL period (`expected_scl_period_cycles()`),
+ * but not of the lower bound.
+ *
+ * Resulting SCL frequencies (upper bound and expected incl. wait states):
+ *
+ *     CPU MHz  bus kHz  loops  max SCL kHz  expected SCL kHz
+ *           8      100     10           97                97
+ *           8      400      3          307               307
+ *           8     1000      1          800               800
+ *          48      100     60           99                80
+ *          48      400     15          393               320
+ *          48     1000      6          960               800
+ *
+ * The figures are derived, not measured. The expected column still
+ * excludes the compiler dependent instructions mentioned above.
+ *
+ * The model only depends on the CPU and bus frequencies so it can also be
+ * evaluated on the host (see `test/test_i2c_timing`).
+ */
+struct i2c_bit_bang_timing {
+    /// Minimum CPU cycles per SCL phase spent outside the delay loop (STR and MOVS)
+    static constexpr uint32_t phase_overhead_cycles = 3;
+
+    /// CPU cycles per delay loop iteration with taken branch (SUBS 1, BNE 3)
+    static constexpr uint32_t loop_cycles = 4;
+
+    /// CPU cycles saved by the last delay loop iteration (BNE not taken: 1 instead of 3)
+    static constexpr uint32_t last_loop_saved_cycles = 2;
+
+    /// Flash wait states (0 up to 24MHz, 1 above)
+    static constexpr uint32_t flash_wait_states(uint32_t cpu_freq) {
+        return cpu_freq > 24000000 ? 1 : 0;
+    }
+
+    /// Minimum CPU cycles of an SCL phase with the given number of delay loop iterations
+    static constexpr uint32_t phase_cycles(uint32_t loops) {
+        return phase_overhead_cycles + loops * loop_cycles - last_loop_saved_cycles;
+    }
+
+    /// Number of delay loop iterations per SCL phase (at least 1)
+    static constexpr uint32_t delay_loops(uint32_t cpu_freq, uint32_t bus_freq) {
+        // Half the SCL period, rounded up
+        uint32_t target_cycles = (cpu_freq + 2 * bus_freq - 1) / (2 * bus_freq);
+        if (target_cycles <= phase_cycles(1))
+            return 1;
+        return (target_cycles - phase_overhead_cycles + last_loop_saved_cycles + loop_cycles - 1) / loop_cycles;
+    }
+
+    /// Resulting minimum SCL period (in CPU cycles)
+    static constexpr uint32_t scl_period_cycles(uint32_t cpu_freq, uint32_t bus_freq) {
+        return 2 * phase_cycles(delay_loops(cpu_freq, bus_freq));
+    }
+
+    /// Resulting expected SCL period incl. flash wait states of the taken branches (in CPU cycles)
+    static constexpr uint32_t expected_scl_period_cycles(uint32_t cpu_freq, uint32_t bus_freq) {
+        return scl_period_cycles(cpu_freq, bus_freq)
+               + 2 * (delay_loops(cpu_freq, bus_freq) - 1) * flash_wait_states(cpu_freq);
+    }
+
+    /// Resulting minimum SCL period (in ns)
+    static constexpr uint32_t scl_period_ns(uint32_t cpu_freq, uint32_t bus_freq) {
+        return static_cast<uint32_t>(static_cast<uint64_t>(scl_period_cycles(cpu_freq, bus_freq)) * 1000000000
+                                     / cpu_freq);
+    }
+
+    /// Resulting maximum throughput (in bytes per second, 9 SCL periods per byte incl. ACK)
+    static constexpr uint32_t bytes_per_second(uint32_t cpu_freq, uint32_t bus_freq) {
+        return cpu_freq / (9 * scl_period_cycles(cpu_freq, bus_freq));
+    }
+};
+
+static_assert(i2c_bit_bang_timing::phase_cycles(1) == 3 + 2, "single iteration: SUBS and BNE not taken");
+static_assert(i2c_bit_bang_timing::phase_cycles(3) == 3 + 10, "4n - 2 cycles for n iterations");
+static_assert(i2c_bit_bang_timing::scl_period_ns(48000000, 100000) >= 10000, "bus faster than 100kHz");
+static_assert(i2c_bit_bang_timing::scl_period_ns(48000000, 400000) >= 2500, "bus faster than 400kHz");
+static_assert(i2c_bit_bang_timing::scl_period_ns(48000000, 1000000) >= 1000, "bus faster than 1MHz");
+static_assert(i2c_bit_bang_timing::scl_period_ns(8000000, 100000) >= 10000, "bus faster than 100kHz");
+static_assert(i2c_bit_bang_timing::scl_period_ns(8000000, 400000) >= 2500, "bus faster than 400kHz");
+static_assert(i2c_bit_bang_timing::scl_period_ns(8000000, 1000000) >= 1000, "bus faster than 1MHz");
+
+} // namespace usb_pd
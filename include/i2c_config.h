@@ -0,0 +1,29 @@
+//
+// USB Power Delivery Sink Using FUSB302B
+// Copyright (c) 2020 Manuel Bleichenbacher
+//
+// Licensed under MIT License
+// https://opensource.org/licenses/MIT
+//
+// I2C bus configuration
+//
+
+#pragma once
+
+// I2C bus implementation used to communicate with the FUSB302B:
+//   - default: bit banging on PA9/PA10 (see `i2c_bit_bang`)
+//   - PD_I2C_HW: I2C1 peripheral with DMA (see `i2c_hw`)
+//   - PD_I2C_TIMER_DMA: bit banging offloaded to TIM1 and DMA (see `i2c_timer_dma`)
+
+#if defined(PD_I2C_HW) && defined(PD_I2C_TIMER_DMA)
+#error "PD_I2C_HW and PD_I2C_TIMER_DMA are mutually exclusive"
+#endif
+
+// I2C bus speed (in kHz): 100 (standard mode), 400 (fast mode) or 1000 (fast mode plus)
+#if !defined(PD_I2C_SPEED_KHZ)
+#define PD_I2C_SPEED_KHZ 400
+#endif
+
+#if PD_I2C_SPEED_KHZ != 100 && PD_I2C_SPEED_KHZ != 400 && PD_I2C_SPEED_KHZ != 1000
+#error "PD_I2C_SPEED_KHZ must be 100, 400 or 1000"
+#endif
@@ -0,0 +1,59 @@
+//
+// USB Power Delivery Sink Using FUSB302B
+// Copyright (c) 2020 Manuel Bleichenbacher
+//
+// Licensed under MIT License
+// https://opensource.org/licenses/MIT
+//
+// I2C using the I2C1 peripheral and DMA
+//
+
+#pragma once
+
+#include <stdint.h>
+
+#include "i2c_bit_bang_timing.h"
+
+namespace usb_pd {
+
+/**
+ * I2C master using the I2C1 peripheral.
+ *
+ * Transfers of more than a few bytes (FIFO reads and writes) are
+ * executed by DMA (channel 2 for TX, channel 3 for RX) while the MCU
+ * sleeps until the I2C1 interrupt signals the end of the transfer.
+ *
+ * I2C1 uses PA9 as SCL and PA10 as SDA (alternate function 4).
+ *
+ * **It does not work on an unmodified ZY12PDN board.** The board connects
+ * the FUSB302B the other way around (SDA on PA9, SCL on PA10) and has no
+ * pull-up resistor on SCL. The board needs to be reworked so that PA9 is
+ * connected to SCL and PA10 to SDA, each with an external pull-up resistor
+ * (e.g. 4.7kΩ, 2.2kΩ for 1MHz). The internal pull-ups are too weak for
+ * fast mode and fast mode plus.
+ *
+ * Enable it with the build flag `PD_I2C_HW`.
+ */
+struct i2c_hw {
+    void init();
+
+    /// Adapts the bus recovery timing to the current system clock (I2C1 itself is clocked by HSI)
+    void update_clock();
+
+    bool write_data(uint8_t addr, uint8_t reg, int data_len, const uint8_t* data, bool end_with_stop = true);
+    bool read_data(uint8_t addr, uint8_t reg, int data_len, uint8_t* data);
+
+    /// Frees a device holding SDA low by clocking it out, followed by a STOP condition
+    void recover_bus();
+
+  private:
+    bool write_reg_addr(uint8_t addr, uint8_t reg, int data_len, bool autoend);
+    bool wait_for(uint32_t flags, bool sleep);
+    void abort_transfer();
+    void recovery_delay();
+
+    /// Number of delay loop iterations per SCL phase during bus recovery
+    uint32_t recovery_delay_loops = 1;
+};
+
+} // namespace usb_pd
@@ -0,0 +1,110 @@
+//
+// USB Power Delivery Sink Using FUSB302B
+// Copyright (c) 2020 Manuel Bleichenbacher
+//
+// Licensed under MIT License
+// https://opensource.org/licenses/MIT
+//
+// Profiling of I2C communication with the FUSB302B
+//
+
+#pragma once
+
+#include <stdint.h>
+
+#include "fusb302_regs.h"
+
+namespace usb_pd {
+
+/// Profiling data of a single FUSB302B register
+struct i2c_reg_profile {
+    /// Number of I2C transactions starting at the register (incl. retries)
+    uint32_t transactions;
+    /// Number of data bytes transferred (excl. address bytes)
+    uint32_t bytes;
+    /// Time the bus was busy with these transactions (in µs)
+    uint32_t bus_time_us;
+};
+
+/**
+ * Profiler for the I2C communication with the FUSB302B.
+ *
+ * Counts the transactions, data bytes and the bus time per register.
+ * Burst reads and writes are accounted to the first register. Transactions
+ * starting at an undefined register address (0x00, 0x11 to 0x3b, above 0x43)
+ * are ignored.
+ *
+ * Enable it with the build flag `PD_I2C_PROFILE`. The profile is printed
+ * with `dump()` and `stream()` (requires `PD_DEBUG`).
+ */
+struct i2c_profiler {
+    /// Clears all counters
+    void reset();
+
+    /**
+     * Records a completed transaction.
+     *
+     * @param r first register of the transaction
+     * @param data_len number of data bytes
+     * @param bus_time_us time the bus was busy (in µs)
+     */
+    void record(reg r, int data_len, uint32_t bus_time_us);
+
+    /// Gets the profile of the specified register (all zero for undefined registers)
+    const i2c_reg_profile& profile(reg r);
+
+    /// Gets the total number of transactions
+    uint32_t total_transactions();
+
+    /// Gets the total bus time (in µs)
+    uint32_t total_bus_time_us();
+
+    /**
+     * Starts printing the profile of all used registers to the debug output.
+     *
+     * The profile is printed by `stream()`, line by line as space in the
+     * debug output buffer becomes available. The counters of each register
+     * are cleared when they have been printed.
+     */
+    void dump();
+
+    /**
+     * Continues printing the profile (if a dump has been started).
+     *
+     * Only as many lines are printed as fit into the debug output buffer.
+     * Shall be called regularly from the main loop.
+     */
+    void stream();
+
+  private:
+    /// Number of registers (DEVICE_ID to CONTROL4 and STATUS0A to FIFOS)
+    constexpr static int num_regs = (reg_control4 - reg_device_id + 1) + (reg_fifos - reg_status0a + 1);
+
+    /// Maps the sparse register address to the index in `regs` (-1 for undefined registers)
+    static int index(reg r) {
+        if (r >= reg_device_id && r <= reg_control4)
+            return r - reg_device_id;
+        if (r >= reg_status0a && r <= reg_fifos)
+            return r - reg_status0a + (reg_control4 - reg_device_id + 1);
+        return -1;
+    }
+
+    /// Maps the index in `regs` to the register address
+    static reg reg_at(int idx) {
+        return static_cast<reg>(idx <= reg_control4 - reg_device_id ? idx + reg_device_id
+                                                                    : idx - reg_control4 + reg_status0a);
+    }
+
+    i2c_reg_profile regs[num_regs];
+
+    /// Next line to print (0: header, 1 to `num_regs`: registers, `num_regs + 1`: total, -1: no dump)
+    int dump_line = -1;
+
+    /// Total number of transactions when the dump was started
+    uint32_t dump_transactions = 0;
+
+    /// Total bus time when the dump was started (in µs)
+    uint32_t dump_bus_time_us = 0;
+};
+
+} // namespace usb_pd
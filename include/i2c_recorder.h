@@ -0,0 +1,110 @@
+//
+// USB Power Delivery Sink Using FUSB302B
+// Copyright (c) 2020 Manuel Bleichenbacher
+//
+// Licensed under MIT License
+// https://opensource.org/licenses/MIT
+//
+// Recording of I2C communication with the FUSB302B
+//
+
+#pragma once
+
+#include <stdint.h>
+
+#if defined(PD_I2C_RECORD) && !defined(PD_DEBUG)
+#error "PD_I2C_RECORD requires PD_DEBUG"
+#endif
+
+namespace usb_pd {
+
+/**
+ * Recorder for the I2C communication with the FUSB302B.
+ *
+ * Each register access (as seen by `fusb302`, i.e. after retries) is
+ * stored in a RAM ring buffer and later streamed to the debug output,
+ * one line per access:
+ *
+ *     @<time> <port>:<dir><reg>[!] <data>
+ *
+ * `<time>` is the time in µs (decimal, wraps around after about 71 minutes;
+ * sub-millisecond resolution keeps the order of close accesses when replayed),
+ * `<port>` the PD controller index,
+ * `<dir>` is `R` for reads and `W` for writes, `<reg>` the register address
+ * (2 hex digits), `!` marks a failed access and `<data>` are the data bytes
+ * (hex, omitted for failed reads).
+ * If the ring buffer overflows, the line `@<time> lost <n>` reports the
+ * number of discarded accesses.
+ *
+ * Together with the initial state, the read data is sufficient to reproduce
+ * the behavior of `fusb302` and `pd_sink` (see the host test `test_replay`).
+ *
+ * The recorder is only used from the main loop. With `PD_ISR_RX`, the
+ * accesses of the INT_N interrupt handler are not recorded.
+ *
+ * Enable it with the build flag `PD_I2C_RECORD` (requires `PD_DEBUG`).
+ */
+struct i2c_recorder {
+    /// Clears the ring buffer
+    void reset();
+
+    /**
+     * Records a register access.
+     *
+     * @param port PD controller index
+     * @param is_write `true` for write access, `false` for read access
+     * @param reg first register address
+     * @param success indicates if the I2C transaction was successful
+     * @param data_len number of data bytes
+     * @param data data bytes
+     * @param time time of the access (in µs)
+     */
+    void record(int port, bool is_write, uint8_t reg, bool success, int data_len, const uint8_t* data, uint32_t time);
+
+    /**
+     * Streams recorded accesses to the debug output.
+     *
+     * Only as many accesses are streamed as fit into the debug output buffer.
+     * Shall be called regularly from the main loop.
+     */
+    void stream();
+
+    /// Gets the number of discarded accesses (ring buffer overflow)
+    uint32_t lost() { return total_lost; }
+
+  private:
+    /// Size of ring buffer (in bytes)
+    constexpr static int buf_len = 512;
+
+    /// Size of record header (flags and length, port, register, 4 bytes timestamp)
+    constexpr static int header_len = 7;
+
+    /// Maximum number of data bytes per record
+    constexpr static int max_data_len = 0x3f;
+
+    /// Flag in first header byte indicating write access
+    constexpr static uint8_t flag_write = 0x80;
+
+    /// Flag in first header byte indicating a failed access
+    constexpr static uint8_t flag_failed = 0x40;
+
+    void put(uint8_t b);
+    uint8_t get();
+
+    /// Ring buffer (`head` == `tail` => empty)
+    uint8_t buf[buf_len];
+
+    /// Position where the next byte is inserted
+    int head = 0;
+
+    /// Position of the oldest byte
+    int tail = 0;
+
+    /// Number of accesses discarded since last streamed
+    uint32_t num_lost = 0;
+
+    /// Total number of discarded accesses
+    uint32_t total_lost = 0;
+};
+
+} // namespace usb_pd
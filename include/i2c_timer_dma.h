@@ -0,0 +1,61 @@
+//
+// USB Power Delivery Sink Using FUSB302B
+// Copyright (c) 2020 Manuel Bleichenbacher
+//
+// Licensed under MIT License
+// https://opensource.org/licenses/MIT
+//
+// I2C bit banging using a timer and DMA
+//
+
+#pragma once
+
+#include <stdint.h>
+
+#include "i2c_bit_bang.h"
+
+namespace usb_pd {
+
+/**
+ * I2C bit banging offloaded to timer and DMA.
+ *
+ * Uses the same pins and electrical configuration as `i2c_bit_bang` (push-pull
+ * SCL, open-drain SDA). For longer transfers, the waveform of the data bytes
+ * is streamed as precomputed BSRR words to the GPIO port by DMA channel 5,
+ * triggered by the TIM1 update event. SDA is sampled into a second buffer
+ * by DMA channel 4, triggered by TIM1 compare channel 4.
+ *
+ * Each bit consists of three timer periods (SCL low, set SDA, SCL high).
+ * The buffers hold the waveform of two bytes and are refilled byte by
+ * byte from the DMA interrupt while the MCU sleeps.
+ *
+ * START and STOP conditions, the address bytes and short transfers are
+ * still bit banged by the CPU.
+ *
+ * Enable it with the build flag `PD_I2C_TIMER_DMA`.
+ */
+struct i2c_timer_dma {
+    void init();
+
+    /// Adapts the timing to the current system clock
+    void update_clock();
+
+    bool write_data(uint8_t addr, uint8_t reg, int data_len, const uint8_t* data, bool end_with_stop = true);
+    bool read_data(uint8_t addr, uint8_t reg, int data_len, uint8_t* data);
+
+    /// Frees a device holding SDA low by clocking it out, followed by a STOP condition
+    void recover_bus() { bit_bang.recover_bus(); }
+
+  private:
+    bool transfer(const uint8_t* tx_data, uint8_t* rx_data, int data_len);
+
+    i2c_bit_bang bit_bang;
+
+    /// Timer counter value at which SDA is sampled
+    uint32_t sample_pos = 0;
+
+    /// Duration of a byte transferred by timer and DMA (in µs, rounded up)
+    uint32_t byte_time_us = 0;
+};
+
+} // namespace usb_pd
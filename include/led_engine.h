@@ -0,0 +1,76 @@
+//
+// USB Power Delivery Sink Using FUSB302B
+// Copyright (c) 2020 Manuel Bleichenbacher
+//
+// Licensed under MIT License
+// https://opensource.org/licenses/MIT
+//
+// Timer driven RGB LED
+//
+
+#pragma once
+
+#include <stdint.h>
+
+#include "hal.h"
+
+namespace usb_pd {
+
+/**
+ * RGB LED driven by TIM3.
+ *
+ * Green (PA6) and blue (PA7) are connected to the TIM3 channels 1 and 2.
+ * Red (PA5) has no timer channel. For steady colors, it is therefore
+ * limited to full on or off (intensities are rounded). For flash patterns,
+ * it is switched from the TIM3 interrupt (update event: on, compare
+ * channel 3: off).
+ *
+ * Steady colors with full intensities are set on the GPIO pins and
+ * do not use the timer. Dimmed green and blue use PWM (about 1kHz).
+ * Flash patterns use a 1ms timer tick: the period is the flash period
+ * and the duty cycle is the on time.
+ *
+ * Limitations: flash patterns with red wake the CPU twice per period.
+ * And while the timer is running (PWM or flash pattern), stop mode is
+ * not possible as it would stop the timer (see `is_running()`).
+ */
+struct led_engine {
+    void init();
+
+    /**
+     * Shows a steady color.
+     *
+     * @param c color
+     */
+    void show(rgb_color c);
+
+    /**
+     * Flashes a color.
+     *
+     * Only colors with full or zero intensity per channel can be flashed,
+     * and the period (on + off) is limited to 65535ms.
+     *
+     * @param c color
+     * @param on on duration (in ms)
+     * @param off off duration (in ms)
+     * @return `true` if the flash pattern has been started, `false` if not supported
+     */
+    bool flash(rgb_color c, uint32_t on, uint32_t off);
+
+    /// Adapts the timer to the current system clock
+    void update_clock();
+
+    /// Indicates if the timer is running (it stops in stop mode)
+    bool is_running() { return is_running_; }
+
+  private:
+    void start_timer(uint32_t tick_hz, uint32_t period, uint32_t red, uint32_t green, uint32_t blue);
+    void stop_timer();
+
+    /// Timer tick frequency of the running pattern
+    uint32_t tick_hz = 0;
+
+    bool is_running_ = false;
+};
+
+} // namespace usb_pd
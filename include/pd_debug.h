@@ -23,6 +23,18 @@ namespace usb_pd {
 void debug_log(const char* msg, uint32_t val);
 void debug_init();
 
+/// Gets the number of bytes that can be logged without discarding output
+int debug_tx_space();
+
+/// Indicates if all output has been transmitted
+bool debug_is_tx_idle();
+
+/// Pauses the output before the system clock is changed
+void debug_begin_clock_change();
+
+/// Adapts the output to the new system clock and resumes it
+void debug_end_clock_change();
+
 } // namespace usb_pd
 
 #else
@@ -11,6 +11,7 @@
 #pragma once
 
 #include "fusb302.h"
+#include "timer_service.h"
 
 namespace usb_pd {
 
@@ -70,6 +71,13 @@ enum class callback_event {
 struct pd_sink {
     typedef void (*event_callback)(callback_event event);
 
+    /**
+     * Creates a new instance.
+     *
+     * @param port index of the PD controller (see `mcu_hal::num_pd_ctrls()`)
+     */
+    pd_sink(int port = 0) : pd_controller(port) {}
+
     /**
      * Initialize sink and start listening for USB-PD messages.
      */
@@ -139,6 +147,9 @@ struct pd_sink {
     /// Active power delivery protocol
     pd_protocol protocol() { return protocol_; }
 
+    /// Device ID of the PD controller (product, version and revision; valid after `init()`)
+    const char* device_id() { return version_id; }
+
     /// Number of valid elements in `source_caps` array
     uint8_t num_source_caps = 0;
 
@@ -163,21 +174,79 @@ struct pd_sink {
     /// Specification revision (of last message)
     uint8_t spec_rev = 1;
 
+    /// Time from the last hard or soft reset until the power was ready again (in ms)
+    uint32_t reset_recovery_time = 0;
+
   private:
+    /// Response the sink is waiting for
+    enum class awaited_response {
+        none,
+        /// Accept or Reject for a request
+        accept,
+        /// PS_RDY after a request has been accepted
+        ps_ready,
+        /// Accept for a soft reset
+        soft_reset_accept,
+        /// Source_Capabilities after a soft reset (hard reset if missing)
+        source_caps
+    };
+
     void handle_msg(uint16_t header, const uint8_t* payload);
     void handle_src_cap_msg(uint16_t header, const uint8_t* payload);
     bool update_protocol();
+    void start_reset_recovery();
+    void on_tx_sent(uint16_t header);
+    void on_tx_failed(uint16_t header);
+    static void on_response_timer(void* context);
+    static void on_pps_timer(void* context);
+    static void on_wait_timer(void* context);
+    void on_response_timeout();
+    void await_response(awaited_response response, uint32_t timeout);
+    void send_soft_reset();
+    void send_hard_reset();
     void notify(callback_event event);
     void set_request_payload_fixed(uint8_t* payload, int obj_pos, int voltage, int current);
     void set_request_payload_pps(uint8_t* payload, int obj_pos, int voltage, int current);
 
     fusb302 pd_controller;
+    /// Device ID of the PD controller (see `fusb302::get_device_id()`)
+    char version_id[24] = {};
     event_callback event_callback_ = nullptr;
     pd_protocol protocol_ = pd_protocol::usb_20;
     bool supports_ext_message = false;
 
     int selected_pps_index = -1;
-    uint32_t next_pps_request;
+    /// Timer for re-requesting the PPS voltage (required every 10s)
+    sw_timer pps_timer{on_pps_timer, this};
+
+    /// Index of last requested source capability
+    int requested_index = -1;
+
+    /// Header of last request (for resending it)
+    uint16_t request_header = 0;
+    /// Payload of last request (for resending it)
+    uint8_t request_payload[4] = {};
+    /// Timer for resending the last request after the source has replied with Wait
+    sw_timer wait_timer{on_wait_timer, this};
+
+    /// Response the sink is waiting for
+    awaited_response awaiting = awaited_response::none;
+    /// Timer for the response of the source
+    sw_timer response_timer{on_response_timer, this};
+
+    /// Index of source capability of the current contract (-1 if none)
+    int contract_index = -1;
+    /// Source capability of the current contract
+    source_capability contract_cap;
+    /// Voltage of the current contract (in mV)
+    uint16_t contract_voltage = 0;
+    /// Maximum current of the current contract (in mA)
+    uint16_t contract_max_current = 0;
+
+    /// Indicates if the sink is recovering from a hard or soft reset
+    bool is_recovering = false;
+    /// Time of the last hard or soft reset
+    uint32_t reset_time = 0;
 };
 
 } // namespace usb_pd
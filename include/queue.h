@@ -10,6 +10,9 @@
 
 #pragma once
 
+#include <atomic>
+#include <new>
+#include <type_traits>
 #include <utility>
 
 namespace usb_pd {
@@ -19,22 +22,38 @@ namespace usb_pd {
  *
  * The queue operates according to FIFO: first-in, first-out.
  *
- * The queue is multi-threading and interrupt safe if it is
- * used by a single reader and a single writer.
+ * The queue is lock-free and interrupt safe if it is used by a single
+ * reader and a single writer (e.g. an interrupt handler adding items
+ * and the main loop removing them). `clear()` must be called by the reader.
+ *
+ * The capacity N must be a power of 2.
  */
 template <class T, int N> struct queue {
+    static_assert(N > 0 && (N & (N - 1)) == 0, "queue capacity must be a power of 2");
+    static_assert(std::is_trivially_destructible<T>::value, "queue items must be trivially destructible");
+
   private:
-    /// Allocation size
-    static constexpr int BUF_SIZE = N + 1;
+    static constexpr unsigned MASK = N - 1;
+
+    // Free-running counters (index into buffer: counter & MASK)
+    // head - tail: number of items
+    std::atomic<unsigned> buf_head; // updated when adding data (by writer)
+    std::atomic<unsigned> buf_tail; // updated when removing data (by reader)
+
+    // Statistics (updated by writer)
+    std::atomic<unsigned> max_items;
+    std::atomic<unsigned> num_drops;
+
+    T buffer[N];
+
+    /// Returns the buffer slot for the next item, or `nullptr` if the queue is full
+    T* next_slot();
 
-    // 0 <= head < BUF_SIZE
-    // 0 <= tail < BUF_SIZE
-    // head == tail: buffer is empty
-    // Therefore, the buffer must never be filled completely.
-    volatile int buf_head; // updated when adding data
-    volatile int buf_tail; // updated when removing data
+    /// Makes the item in the next slot available to the reader
+    void commit_slot();
 
-    T buffer[BUF_SIZE];
+    /// Counts an item that has been discarded because the queue was full
+    void count_drop();
 
   public:
     /// Constructs a new queue instance
@@ -46,87 +65,132 @@ template <class T, int N> struct queue {
     /// Returs the number of items in the queue
     int num_items();
 
-    /// Adds item to queue
+    /**
+     * Adds item to queue.
+     *
+     * If the queue is full, the caller keeps the item: it is not counted as dropped.
+     *
+     * @return `true` if the item has been added, `false` if the queue is full
+     */
+    bool try_push(const T& item);
+
+    /**
+     * Constructs an item in place at the end of the queue.
+     *
+     * If the queue is full, nothing is constructed: it is not counted as dropped.
+     *
+     * @return `true` if the item has been added, `false` if the queue is full
+     */
+    template <class... Args> bool emplace(Args&&... args);
+
+    /// Adds item to queue (dropped and counted if the queue is full)
     void add_item(T& item);
 
-    /// Adds item to queue
+    /// Adds item to queue (dropped and counted if the queue is full)
     void add_item(T&& item);
 
-    /// Removes item from queue
+    /**
+     * Removes the oldest item from the queue.
+     *
+     * @param item receives the removed item
+     * @return `true` if an item has been removed, `false` if the queue is empty
+     */
+    bool try_pop(T& item);
+
+    /// Removes item from queue (returns `T()` if the queue is empty)
     T pop_item();
 
     /// Removes all items
     void clear();
+
+    /// Returns the maximum number of items that have been in the queue
+    int high_water() { return max_items.load(std::memory_order_relaxed); }
+
+    /// Returns the number of items dropped by `add_item()` because the queue was full
+    unsigned drops() { return num_drops.load(std::memory_order_relaxed); }
 };
 
-template <class T, int N> queue<T, N>::queue() : buf_head(0), buf_tail(0) {}
+template <class T, int N> queue<T, N>::queue() : buf_head(0), buf_tail(0), max_items(0), num_drops(0) {}
 
 template <class T, int N> int queue<T, N>::avail_items() {
-    int head = buf_head;
-    int tail = buf_tail;
-
-    if (head >= tail) {
-        return BUF_SIZE - (head - tail) - 1;
-    } else {
-        return tail - head - 1;
-    }
+    return N - num_items();
 }
 
 template <class T, int N> int queue<T, N>::num_items() {
-    int head = buf_head;
-    int tail = buf_tail;
-
-    if (head >= tail) {
-        return head - tail;
-    } else {
-        return BUF_SIZE - (tail - head);
-    }
+    unsigned tail = buf_tail.load(std::memory_order_acquire);
+    unsigned head = buf_head.load(std::memory_order_acquire);
+    return static_cast<int>(head - tail);
 }
 
-template <class T, int N> void queue<T, N>::add_item(T&& item) {
-    int head = buf_head;
+template <class T, int N> T* queue<T, N>::next_slot() {
+    unsigned head = buf_head.load(std::memory_order_relaxed);
+    if (head - buf_tail.load(std::memory_order_acquire) >= static_cast<unsigned>(N))
+        return nullptr; // queue is full
 
-    int new_head = head + 1;
-    if (new_head >= BUF_SIZE)
-        new_head = 0;
+    return &buffer[head & MASK];
+}
 
-    if (new_head == buf_tail)
-        return; // queue full
+template <class T, int N> void queue<T, N>::commit_slot() {
+    unsigned head = buf_head.load(std::memory_order_relaxed) + 1;
+    buf_head.store(head, std::memory_order_release);
 
-    buffer[head] = item;
-    buf_head = new_head;
+    unsigned n = head - buf_tail.load(std::memory_order_relaxed);
+    if (n > max_items.load(std::memory_order_relaxed))
+        max_items.store(n, std::memory_order_relaxed);
 }
 
-template <class T, int N> void queue<T, N>::add_item(T& item) {
-    int head = buf_head;
+template <class T, int N> bool queue<T, N>::try_push(const T& item) {
+    T* slot = next_slot();
+    if (slot == nullptr)
+        return false;
 
-    int new_head = head + 1;
-    if (new_head >= BUF_SIZE)
-        new_head = 0;
+    *slot = item;
+    commit_slot();
+    return true;
+}
 
-    if (new_head == buf_tail)
-        return; // queue is full
+template <class T, int N> template <class... Args> bool queue<T, N>::emplace(Args&&... args) {
+    T* slot = next_slot();
+    if (slot == nullptr)
+        return false;
 
-    buffer[head] = item;
-    buf_head = new_head;
+    new (slot) T(std::forward<Args>(args)...);
+    commit_slot();
+    return true;
 }
 
-template <class T, int N> T queue<T, N>::pop_item() {
-    int tail = buf_tail;
-    if (tail == buf_head)
-        return T(); // queue is empty
+template <class T, int N> void queue<T, N>::add_item(T& item) {
+    if (!try_push(item))
+        count_drop();
+}
+
+template <class T, int N> void queue<T, N>::add_item(T&& item) {
+    if (!try_push(item))
+        count_drop();
+}
+
+template <class T, int N> void queue<T, N>::count_drop() {
+    num_drops.store(num_drops.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
 
-    int new_tail = tail + 1;
-    if (new_tail >= BUF_SIZE)
-        new_tail = 0;
+template <class T, int N> bool queue<T, N>::try_pop(T& item) {
+    unsigned tail = buf_tail.load(std::memory_order_relaxed);
+    if (tail == buf_head.load(std::memory_order_acquire))
+        return false; // queue is empty
 
-    buf_tail = new_tail;
-    return std::move(buffer[tail]);
+    item = std::move(buffer[tail & MASK]);
+    buf_tail.store(tail + 1, std::memory_order_release);
+    return true;
+}
+
+template <class T, int N> T queue<T, N>::pop_item() {
+    T item = T();
+    try_pop(item);
+    return item;
 }
 
 template <class T, int N> void queue<T, N>::clear() {
-    buf_head = 0;
-    buf_tail = 0;
+    buf_tail.store(buf_head.load(std::memory_order_acquire), std::memory_order_release);
 }
 
 } // namespace usb_pd
@@ -0,0 +1,124 @@
+//
+// USB Power Delivery Sink Using FUSB302B
+// Copyright (c) 2020 Manuel Bleichenbacher
+//
+// Licensed under MIT License
+// https://opensource.org/licenses/MIT
+//
+// Software timers
+//
+
+#pragma once
+
+#include <stdint.h>
+
+namespace usb_pd {
+
+/// Function called when a timer expires
+typedef void (*timer_callback)(void* context);
+
+/**
+ * Software timer.
+ *
+ * Timers are statically allocated by the modules using them (usually as
+ * member variables) and are started and cancelled with `timer_service`.
+ * When a timer expires, its callback is called once.
+ */
+struct sw_timer {
+    /**
+     * Creates a new timer (not yet started).
+     *
+     * @param callback function called when the timer expires
+     * @param context context passed to the callback
+     */
+    sw_timer(timer_callback callback, void* context = nullptr) : callback(callback), context(context) {}
+
+    /// Indicates if the timer has been started and has not yet expired or been cancelled
+    bool is_active() { return is_active_; }
+
+  private:
+    friend struct timer_service;
+
+    timer_callback callback;
+    void* context;
+
+    /// Time when the timer expires (in µs, see `mcu_hal::micros()`)
+    uint64_t deadline = 0;
+
+    /// Next timer in list of active timers
+    sw_timer* next = nullptr;
+
+    bool is_active_ = false;
+};
+
+/**
+ * Timer service.
+ *
+ * Manages all active timers in a list sorted by deadline and calls the
+ * callbacks of expired timers from `poll()`. As the callbacks are called
+ * in the main loop, they can use all services.
+ *
+ * The timer service is not interrupt safe: timers must not be started
+ * or cancelled from interrupt handlers.
+ */
+struct timer_service {
+    /// Deadline returned if no timer is active
+    static constexpr uint64_t no_deadline = UINT64_MAX;
+
+    /**
+     * Starts a timer (or restarts it if it is active).
+     *
+     * @param timer timer
+     * @param ms time until it expires (in ms)
+     */
+    void start(sw_timer& timer, uint32_t ms);
+
+    /**
+     * Starts a timer (or restarts it if it is active).
+     *
+     * @param timer timer
+     * @param us time until it expires (in µs)
+     */
+    void start_us(sw_timer& timer, uint64_t us);
+
+    /// Cancels a timer (no effect if it is not active)
+    void cancel(sw_timer& timer);
+
+    /**
+     * Calls the callbacks of all expired timers.
+     *
+     * Needs to be called frequently from the main loop.
+     */
+    void poll();
+
+    /// Returns the deadline of the next timer to expire (in µs, `no_deadline` if no timer is active)
+    uint64_t next_deadline();
+
+    /**
+     * Indicates if the next timer is due.
+     *
+     * Can be called from interrupt handlers. If it interrupts a timer
+     * update, it returns `false` and the check is repeated with the
+     * next call.
+     *
+     * @param now current time (in µs, see `mcu_hal::micros()`)
+     */
+    bool is_due(uint64_t now);
+
+  private:
+    void remove(sw_timer& timer);
+    void update_next_deadline();
+
+    /// Active timer with earliest deadline (start of sorted list)
+    sw_timer* first = nullptr;
+
+    /// Indicates if a timer is active (copy for interrupt handlers)
+    volatile bool has_deadline = false;
+
+    /// Deadline of the next timer to expire (in µs, copy for interrupt handlers, valid if `has_deadline` is set)
+    volatile uint64_t next_deadline_us = 0;
+};
+
+extern timer_service timers;
+
+} // namespace usb_pd
@@ -0,0 +1,52 @@
+//
+// USB Power Delivery Sink Using FUSB302B
+// Copyright (c) 2020 Manuel Bleichenbacher
+//
+// Licensed under MIT License
+// https://opensource.org/licenses/MIT
+//
+// Event flag dispatcher for the main loop
+//
+
+#include "dispatcher.h"
+
+#include <libopencm3/cm3/cortex.h>
+
+namespace usb_pd {
+
+void event_dispatcher::set_handler(subsystem sub, work_handler handler, void* context) {
+    int index = static_cast<int>(sub);
+    contexts[index] = context;
+    handlers[index] = handler;
+}
+
+void event_dispatcher::signal(subsystem sub) {
+    // Cortex-M0 has no atomic read-modify-write instructions
+    uint32_t primask = cm_mask_interrupts(1);
+    pending = pending | (1 << static_cast<int>(sub));
+    cm_mask_interrupts(primask);
+}
+
+void event_dispatcher::run() {
+    while (true) {
+        // Take the pending subsystem with the highest priority
+        cm_disable_interrupts();
+        uint32_t flags = pending;
+        int index = 0;
+        if (flags != 0) {
+            while ((flags & (1 << index)) == 0)
+                index++;
+            pending = flags & ~(1 << index);
+        }
+        cm_enable_interrupts();
+
+        if (flags == 0)
+            return;
+
+        dispatch_counts[index]++;
+        if (handlers[index] != nullptr)
+            handlers[index](contexts[index]);
+    }
+}
+
+} // namespace usb_pd
@@ -13,6 +13,7 @@
 
 #include <string.h>
 
+#include "dispatcher.h"
 #include "hal.h"
 #include "pd_debug.h"
 
@@ -22,6 +23,36 @@ static const char* const PRODUCT_IDS[] = {"FUSB302B__X", "FUSB302B01MPX", "FUSB3
 
 static const char* VERSIONS = "????????ABCDEFGH";
 
+// Candidate SLICE settings (BMC threshold and hysteresis) in the order they are tried.
+// The threshold DAC has a resolution of 42mV.
+static const uint8_t SLICE_SETTINGS[] = {
+    slice_sdac_hys_085mv | 0x20, // 1.34V, 85mV
+    slice_sdac_hys_170mv | 0x20, // 1.34V, 170mV
+    slice_sdac_hys_085mv | 0x1d, // 1.22V, 85mV
+    slice_sdac_hys_085mv | 0x23, // 1.47V, 85mV
+    slice_sdac_hys_170mv | 0x1d, // 1.22V, 170mV
+    slice_sdac_hys_170mv | 0x23, // 1.47V, 170mV
+};
+
+// Reset values of the shadowed registers SWITCHES0 to CONTROL4 (see datasheet)
+static const uint8_t SHADOW_RESET_VALUES[] = {
+    0x03, // SWITCHES0
+    0x20, // SWITCHES1
+    0x31, // MEASURE
+    0x60, // SLICE
+    0x24, // CONTROL0
+    0x00, // CONTROL1
+    0x02, // CONTROL2
+    0x06, // CONTROL3
+    0x00, // MASK
+    0x01, // POWER
+    0x00, // RESET
+    0x0f, // OCPREG
+    0x00, // MASKA
+    0x00, // MASKB
+    0x00, // CONTROL4
+};
+
 void fusb302::get_device_id(char* device_id_buf) {
     uint8_t device_id = read_register(reg_device_id);
     uint8_t version_id = device_id >> 4;
@@ -40,49 +71,116 @@ void fusb302::init() {
     write_register(reg_reset, reset_sw_res | reset_pd_reset);
     hal.delay(10);
 
+    // initialize shadow registers with reset values
+    static_assert(sizeof(SHADOW_RESET_VALUES) == num_shadow_regs, "reset values do not match shadow registers");
+    if (read_registers(shadow_first_reg, num_shadow_regs, shadow_regs)) {
+        dirty_regs = 0;
+    } else {
+        // Register contents are unknown (the reset might have failed as well):
+        // assume the datasheet reset values and write all of them (except RESET)
+        DEBUG_LOG("Shadow init failed\r\n", 0);
+        memcpy(shadow_regs, SHADOW_RESET_VALUES, num_shadow_regs);
+        dirty_regs = ((1 << num_shadow_regs) - 1) & ~(1 << (reg_reset - shadow_first_reg));
+    }
+
     // power up everyting except oscillator
-    write_register(reg_power, power_pwr_all & ~power_pwr_int_osc);
+    set_register(reg_power, power_pwr_all & ~power_pwr_int_osc);
     // Disable all CC monitoring
-    write_register(reg_switches0, switches0_none);
+    set_register(reg_switches0, switches0_none);
     // Mask all interrupts
-    write_register(reg_mask, mask_m_all);
+    set_register(reg_mask, mask_m_all);
     // Mask all interrupts
-    write_register(reg_maska, maska_m_all);
+    set_register(reg_maska, maska_m_all);
     // Mask all interrupts (incl. good CRC sent)
-    write_register(reg_maskb, maskb_m_all);
+    set_register(reg_maskb, maskb_m_all);
+    flush_registers();
 
     next_message_id = 0;
-    is_timeout_active = false;
-    state_ = fusb302_state::usb_20;
+    is_tx_pending = false;
+    cancel_timeout();
+    set_state(fusb302_state::usb_20);
     events.clear();
+    rx_bufs.reset();
+    consumed_payload = nullptr;
+
+#if defined(PD_ISR_RX)
+    has_isr_status = false;
+    isr_msgs.clear();
+    hal.set_int_n_handler(port_, int_n_handler, this);
+#endif
 }
 
 void fusb302::start_sink() {
+    // BMC threshold (1.35V with a hysteresis of 85mV unless calibrated otherwise)
+    set_register(reg_slice, SLICE_SETTINGS[slice_index]);
+
+#if defined(PD_HW_TOGGLE)
+    start_toggling();
+#else
     // As the interrupt line is also used as SWDIO, the FUSB302B interrupt is
     // not activated until activity on CC1 or CC2 has been detected.
     // Thus, CC1 and CC2 have to be polled manually even though the FUSB302B
     // could do it automatically.
-
-    // BMC threshold: 1.35V with a threshold of 85mV
-    write_register(reg_slice, slice_sdac_hys_085mv | 0x20);
-
     start_measurement(1);
+#endif
 }
 
 void fusb302::poll() {
-    if (hal.is_interrupt_asserted()) {
+    if (consecutive_bus_errors >= max_consecutive_bus_errors) {
+        // The bus errors persist: reset the FUSB302 as a last resort
+        DEBUG_LOG("%lu: I2C failure\r\n", hal.millis());
+        consecutive_bus_errors = 0;
+        establish_retry_wait();
+
+#if defined(PD_ISR_RX)
+    } else if (has_isr_status || has_isr_bus_error || isr_msgs.num_items() != 0) {
+        check_for_isr_events();
+
+    } else if (hal.is_interrupt_asserted(port_) || is_isr_retry_needed) {
+        // Interrupt has not been handled (e.g. after an I2C error)
+        hal.trigger_int_n_handler(port_);
+#else
+    } else if (hal.is_interrupt_asserted(port_) || has_pending_rx) {
         check_for_interrupts();
+#endif
 
     } else if (has_timeout_expired()) {
         if (state_ == fusb302_state::usb_pd_wait) {
             DEBUG_LOG("%lu: No CC activity\r\n", hal.millis());
+            retry_stats_.pd_wait_timeouts++;
+            if (!is_recovering_from_hard_reset) {
+                // Give slow sources more time next time
+                pd_wait_ms *= 2;
+                if (pd_wait_ms > retry_policy.max_pd_wait_ms)
+                    pd_wait_ms = retry_policy.max_pd_wait_ms;
+            }
             establish_retry_wait();
         } else if (state_ == fusb302_state::usb_20) {
+#if defined(PD_HW_TOGGLE)
+            // No source has been found since the retry reset
+            report_attached(false);
+#else
             check_measurement();
+#endif
         } else if (state_ == fusb302_state::usb_retry_wait) {
             establish_usb_20();
         }
     }
+
+    // Only one kind of work is done per call; come back for the rest
+    if (has_pending_work())
+        dispatcher.signal(subsystem::pd_ctrl);
+}
+
+bool fusb302::has_pending_work() {
+    if (consecutive_bus_errors >= max_consecutive_bus_errors || is_timeout_expired || events.num_items() != 0)
+        return true;
+#if defined(PD_ISR_RX)
+    return has_isr_status || has_isr_bus_error || isr_msgs.num_items() != 0 || is_isr_retry_needed
+        || hal.is_interrupt_asserted(port_);
+#else
+    return has_pending_rx || hal.is_interrupt_asserted(port_);
+#endif
 }
 
 void fusb302::start_measurement(int cc) {
@@ -90,7 +188,8 @@ void fusb302::start_measurement(int cc) {
     sw0 = sw0 | switches0_pdwn1 | switches0_pdwn2;
 
     // test CC
-    write_register(reg_switches0, sw0);
+    set_register(reg_switches0, sw0);
+    flush_registers();
     start_timeout(10);
     measuring_cc = cc;
 }
@@ -99,7 +198,9 @@ void fusb302::check_measurement() {
     read_register(reg_status0);
     uint8_t status0 = read_register(reg_status0);
     if ((status0 & status0_bc_lvl_mask) == 0) {
-        // No CC activity
+        // No CC activity (on both CC lines: the source is gone)
+        if (measuring_cc == 2)
+            report_attached(false);
         start_measurement(measuring_cc == 1 ? 2 : 1);
         return;
     }
@@ -108,134 +209,599 @@ void fusb302::check_measurement() {
     measuring_cc = 0;
 }
 
+#if defined(PD_HW_TOGGLE)
+
+void fusb302::start_toggling() {
+    // Only the toggle done interrupt is enabled. So the FUSB302B does not
+    // assert INT_N (shared with SWDIO) until a source has been attached.
+    // The pin is not reconfigured and SWD remains usable until then.
+    set_register(reg_switches0, switches0_none);
+    set_register(reg_mask, mask_m_all);
+    set_register(reg_maska, maska_m_all & ~maska_m_togdone);
+    set_register(reg_maskb, maskb_m_all);
+    set_register(reg_control0, control0_none);
+    set_register(reg_control2, control2_mode_snk_polling | control2_toggle);
+    flush_registers();
+
+    hal.enable_int_n_wakeup(port_);
+    // A source still attached after a retry reset is detected within a few toggle cycles
+    if (is_attached_reported)
+        start_timeout(toggle_detach_ms);
+    else
+        cancel_timeout();
+}
+
+void fusb302::check_toggle_result(uint8_t status1a) {
+    // Stop toggling so the CC switches can be configured manually
+    set_register(reg_control2, control2_mode_snk_polling);
+    flush_registers();
+
+    uint8_t togss = status1a & status1a_togss_mask;
+    if (togss == status1a_togss_snk_on_cc1) {
+        establish_usb_pd_wait(1);
+    } else if (togss == status1a_togss_snk_on_cc2) {
+        establish_usb_pd_wait(2);
+    } else {
+        // Not a source (or toggling still running); restart toggling
+        DEBUG_LOG("Toggle result %d\r\n", togss >> 3);
+        start_toggling();
+    }
+}
+
+#endif
+
+bool fusb302::read_status(fusb302_status& status) {
+    return read_registers(reg_status0a, sizeof(status), reinterpret_cast<uint8_t*>(&status));
+}
+
 void fusb302::check_for_interrupts() {
-    bool may_have_message = false;
+    // On a bus error, the interrupts remain pending and INT_N stays
+    // asserted. So the next call of `poll()` will try again.
+    fusb302_status status;
+    if (!read_status(status))
+        return;
+
+    if (!handle_interrupts(status))
+        return;
 
-    uint8_t interrupt = read_register(reg_interrupt);
-    uint8_t interrupta = read_register(reg_interrupta);
-    uint8_t interruptb = read_register(reg_interruptb);
+    // The snapshot tells if the RX FIFO contains messages (independent
+    // of I_ACTIVITY, I_CRC_CHK or I_GCRCSENT), so no further check is needed.
+    check_for_msg(status.status1);
+}
+
+bool fusb302::handle_interrupts(const fusb302_status& status) {
+#if defined(PD_HW_TOGGLE)
+    if ((status.interrupta & interrupta_i_togdone) != 0) {
+        check_toggle_result(status.status1a);
+        return false;
+    }
+#endif
 
-    if ((interrupta & interrupta_i_hardrst) != 0) {
+    if ((status.interrupta & interrupta_i_hardrst) != 0) {
         DEBUG_LOG("%lu: Hard reset\r\n", hal.millis());
-        establish_retry_wait();
-        return;
+        retry_stats_.hard_resets++;
+        establish_hard_reset_recovery();
+        return false;
+    }
+
+    if ((status.interrupt & (interrupt_i_vbusok | interrupt_i_bc_lvl | interrupt_i_comp_chng)) != 0) {
+        on_typec_change(status.interrupt, status.status0);
+        if (typec_state_ == typec_state::unattached)
+            return false;
     }
-    if ((interrupta & interrupta_i_retryfail) != 0) {
+    if ((status.interrupta & interrupta_i_hardsent) != 0) {
+        DEBUG_LOG("%lu: Hard reset sent\r\n", hal.millis());
+        establish_hard_reset_recovery();
+        return false;
+    }
+    if ((status.interrupta & interrupta_i_retryfail) != 0) {
         DEBUG_LOG("Retry failed\r\n", 0);
+        write_command(reg_control0, control0_tx_flush);
+        on_tx_completed(event_kind::tx_failed);
     }
-    if ((interrupta & interrupta_i_txsent) != 0) {
+    if ((status.interrupta & interrupta_i_txsent) != 0) {
         DEBUG_LOG("TX ack\r\n", 0);
+        on_tx_completed(event_kind::tx_sent);
+    }
+    if ((status.interrupta & (interrupta_i_retryfail | interrupta_i_txsent)) != 0) {
         // turn off internal oscillator if TX FIFO is empty
-        uint8_t status1 = read_register(reg_status1);
-        if ((status1 & status1_tx_empty) != 0)
-            write_register(reg_power, power_pwr_all & ~power_pwr_int_osc);
+        if ((status.status1 & status1_tx_empty) != 0) {
+            set_register(reg_power, power_pwr_all & ~power_pwr_int_osc);
+            flush_registers();
+        }
     }
-    if ((interrupt & interrupt_i_activity) != 0) {
-        may_have_message = true;
+
+    return true;
+}
+
+void fusb302::check_for_msg(uint8_t status1) {
+    has_pending_rx = false;
+
+    // Per message, three transactions are needed: token and header,
+    // payload and CRC, STATUS0 and STATUS1 (CRC check and FIFO empty).
+    while ((status1 & status1_rx_empty) == 0) {
+        uint32_t start_transactions = num_transactions;
+
+        uint8_t* payload = rx_bufs.lease();
+        if (payload == nullptr) {
+            // Leave message in FIFO until the client has consumed the pending events
+            DEBUG_LOG("No RX buffer\r\n", 0);
+            rx_stats_.buffer_exhaustions++;
+            has_pending_rx = true;
+            break;
+        }
+
+        uint16_t header;
+        if (!read_message(header, payload)) {
+            rx_bufs.release(payload);
+            rx_stats_.transactions += num_transactions - start_transactions;
+            break; // FIFO has been flushed or is retried with the next poll
+        }
+
+        uint8_t status[2];
+        if (read_registers(reg_status0, 2, status)) {
+            calibrate_slice((status[0] & status0_crc_chk) != 0);
+        } else {
+            // The message is complete but the CRC check result is unknown.
+            // Deliver it anyway and check the FIFO again with the next poll.
+            status[0] = status0_crc_chk;
+            status[1] = status1_rx_empty;
+            has_pending_rx = true;
+        }
+        status1 = status[1];
+
+        rx_stats_.transactions += num_transactions - start_transactions;
+        deliver_message(header, payload, (status[0] & status0_crc_chk) != 0);
     }
-    if ((interrupt & interrupt_i_crc_chk) != 0) {
-        // DEBUG_LOG("%lu: CRC ok\r\n", hal.millis());
-        may_have_message = true;
+}
+
+void fusb302::deliver_message(uint16_t header, uint8_t* payload, bool is_crc_valid) {
+    rx_stats_.messages++;
+
+    if (!is_crc_valid) {
+        DEBUG_LOG("Invalid CRC\r\n", 9);
+        rx_stats_.invalid_messages++;
+    } else if (pd_header::message_type(header) == pd_msg_type_ctrl_good_crc) {
+        DEBUG_LOG("Good CRC packet\r\n", 9);
+    } else {
+        if (state_ != fusb302_state::usb_pd)
+            establish_usb_pd();
+        if (events.emplace(header, payload))
+            return; // buffer is released when the event has been consumed
+        DEBUG_LOG("Event queue full\r\n", 0);
     }
-    if ((interruptb & interruptb_i_gcrcsent) != 0) {
-        // DEBUG_LOG("Good CRC sent\r\n", 0);
-        may_have_message = true;
+
+    rx_bufs.release(payload);
+}
+
+#if defined(PD_ISR_RX)
+
+void fusb302::int_n_handler(void* context) {
+    static_cast<fusb302*>(context)->on_int_n();
+}
+
+void fusb302::on_int_n() {
+    is_isr_retry_needed = false;
+
+    fusb302_status status;
+    isr_transactions++;
+    if (!hal.pd_ctrl_read(port_, reg_status0a, sizeof(status), reinterpret_cast<uint8_t*>(&status))) {
+        // INT_N remains asserted; `poll()` will trigger the handler again
+        has_isr_bus_error = true;
+        is_isr_retry_needed = true;
+        return;
     }
-    if (may_have_message)
-        check_for_msg();
+
+    // Interrupt bits are cleared when read; accumulate them until processed
+    bool has_interrupts = has_isr_status;
+    isr_status.status0a = status.status0a;
+    isr_status.status1a = status.status1a;
+    isr_status.status0 = status.status0;
+    isr_status.status1 = status.status1;
+    isr_status.interrupta = has_interrupts ? isr_status.interrupta | status.interrupta : status.interrupta;
+    isr_status.interruptb = has_interrupts ? isr_status.interruptb | status.interruptb : status.interruptb;
+    isr_status.interrupt = has_interrupts ? isr_status.interrupt | status.interrupt : status.interrupt;
+    has_isr_status = true;
+
+    drain_rx_fifo(status.status1);
 }
 
-void fusb302::check_for_msg() {
-    while (true) {
-        uint8_t status1 = read_register(reg_status1);
-        if ((status1 & status1_rx_empty) == status1_rx_empty)
+void fusb302::drain_rx_fifo(uint8_t status1) {
+    while ((status1 & status1_rx_empty) == 0) {
+        if (isr_msgs.avail_items() == 0) {
+            // No free buffer: continue once `poll()` has processed messages
+            is_isr_retry_needed = true;
+            return;
+        }
+
+        isr_rx_msg msg;
+
+        // Read token and header
+        uint8_t buf[3];
+        isr_transactions++;
+        if (!hal.pd_ctrl_read(port_, reg_fifos, 3, buf)) {
+            has_isr_bus_error = true;
+            is_isr_retry_needed = true;
+            return;
+        }
+
+        // Check for SOP token, get payload and CRC
+        int len = pd_header::num_data_objs(buf[1] | (buf[2] << 8)) * 4 + 4;
+        bool is_valid = (buf[0] & 0xe0) == 0xe0;
+        if (is_valid) {
+            isr_transactions++;
+            is_valid = hal.pd_ctrl_read(port_, reg_fifos, len, msg.payload);
+            if (!is_valid)
+                has_isr_bus_error = true;
+        } else {
+            // Malformed frame (counted like in `read_message()`)
+            isr_invalid_messages++;
+        }
+        if (!is_valid) {
+            // Flush RX FIFO (keeping the other bits, see `write_command()`)
+            uint8_t control1 = shadow_regs[reg_control1 - shadow_first_reg] | control1_rx_flush;
+            isr_transactions++;
+            hal.pd_ctrl_write(port_, reg_control1, 1, &control1);
+            return;
+        }
+
+        msg.header = buf[1] | (buf[2] << 8);
+
+        uint8_t status[2];
+        isr_transactions++;
+        msg.is_crc_checked = hal.pd_ctrl_read(port_, reg_status0, 2, status);
+        if (msg.is_crc_checked) {
+            msg.is_crc_valid = (status[0] & status0_crc_chk) != 0;
+            status1 = status[1];
+        } else {
+            // Deliver the message anyway and check the FIFO again later
+            msg.is_crc_valid = true;
+            status1 = status1_rx_empty;
+            has_isr_bus_error = true;
+            is_isr_retry_needed = true;
+        }
+
+        isr_msgs.add_item(msg);
+    }
+}
+
+void fusb302::check_for_isr_events() {
+    // Take over the interrupts captured by the INT_N handler
+    hal.disable_interrupts();
+    bool has_status = has_isr_status;
+    fusb302_status status = isr_status;
+    has_isr_status = false;
+    bool has_bus_error = has_isr_bus_error;
+    has_isr_bus_error = false;
+    uint32_t invalid_messages = isr_invalid_messages;
+    isr_invalid_messages = 0;
+    hal.enable_interrupts();
+
+    rx_stats_.invalid_messages += invalid_messages;
+
+    check_bus_result(!has_bus_error);
+
+    if (has_status && !handle_interrupts(status)) {
+        // Messages received before a reset or detach are obsolete
+        isr_msgs.clear();
+        return;
+    }
+
+    isr_rx_msg msg;
+    while (isr_msgs.num_items() != 0) {
+        uint8_t* payload = rx_bufs.lease();
+        if (payload == nullptr) {
+            // Keep message until the client has consumed the pending events
+            DEBUG_LOG("No RX buffer\r\n", 0);
+            rx_stats_.buffer_exhaustions++;
             break;
+        }
 
-        uint16_t header;
-        uint8_t* payload = rx_message_buf[rx_message_index];
-        read_message(header, payload);
-
-        uint8_t status0 = read_register(reg_status0);
-        if ((status0 & status0_crc_chk) == 0) {
-            DEBUG_LOG("Invalid CRC\r\n", 9);
-        } else if (pd_header::message_type(header) == pd_msg_type_ctrl_good_crc) {
-            DEBUG_LOG("Good CRC packet\r\n", 9);
+        isr_msgs.try_pop(msg);
+        if (msg.is_crc_checked)
+            calibrate_slice(msg.is_crc_valid);
+
+        memcpy(payload, msg.payload, pd_header::num_data_objs(msg.header) * 4);
+        deliver_message(msg.header, payload, msg.is_crc_valid);
+    }
+
+    // Messages remaining in the RX FIFO or failed transactions
+    if (is_isr_retry_needed)
+        hal.trigger_int_n_handler(port_);
+}
+
+#endif
+
+void fusb302::calibrate_slice(bool is_crc_valid) {
+    crc_stats_.messages++;
+    if (!is_crc_valid)
+        crc_stats_.crc_failures++;
+
+    if (is_slice_calibrated)
+        return;
+
+    window_messages++;
+    if (!is_crc_valid)
+        window_failures++;
+
+    // Evaluate the setting after a full window or as soon as it has failed repeatedly
+    if (window_messages < slice_window_len && window_failures < slice_max_failures)
+        return;
+
+    if (window_failures == 0) {
+        is_slice_calibrated = true;
+
+    } else {
+        slice_failures[slice_index] = window_failures;
+
+        if (slice_index + 1 < num_slice_settings) {
+            slice_index++;
         } else {
-            if (state_ != fusb302_state::usb_pd)
-                establish_usb_pd();
-            events.add_item(event(header, payload));
-            rx_message_index++;
-            if (rx_message_index >= num_message_buf)
-                rx_message_index = 0;
+            // All settings have been tried: take the best one
+            slice_index = 0;
+            for (int i = 1; i < num_slice_settings; i++) {
+                if (slice_failures[i] < slice_failures[slice_index])
+                    slice_index = i;
+            }
+            is_slice_calibrated = true;
         }
+
+        crc_stats_.slice_changes++;
+        DEBUG_LOG("SLICE: 0x%02x\r\n", SLICE_SETTINGS[slice_index]);
+        set_register(reg_slice, SLICE_SETTINGS[slice_index]);
+        flush_registers();
     }
+
+    crc_stats_.slice = SLICE_SETTINGS[slice_index];
+    crc_stats_.is_calibrated = is_slice_calibrated;
+    window_messages = 0;
+    window_failures = 0;
+}
+
+void fusb302::reset_slice_calibration() {
+    static_assert(sizeof(SLICE_SETTINGS) == num_slice_settings, "SLICE_SETTINGS must match num_slice_settings");
+
+    slice_index = 0;
+    is_slice_calibrated = false;
+    window_messages = 0;
+    window_failures = 0;
+    crc_stats_.slice = SLICE_SETTINGS[0];
+    crc_stats_.is_calibrated = false;
 }
 
 void fusb302::establish_retry_wait() {
     DEBUG_LOG("Reset\r\n", 0);
 
-    // Reset FUSB302
+    // Reset FUSB302 (disconnects the pull-down resistors)
     init();
-    state_ = fusb302_state::usb_retry_wait;
-    start_timeout(500);
-    events.add_item(event(event_kind::state_changed));
+    is_recovering_from_hard_reset = false;
+    // The detach is not reported until the source is no longer found
+    set_state(fusb302_state::usb_retry_wait);
+    set_typec_state(typec_state::unattached);
+
+    // Exponential backoff for consecutive failures
+    uint32_t wait_ms = retry_policy.max_retry_wait_ms;
+    if (num_failures < 16 && (retry_policy.retry_wait_ms << num_failures) < wait_ms)
+        wait_ms = retry_policy.retry_wait_ms << num_failures;
+    num_failures++;
+    retry_stats_.retries++;
+    start_timeout(wait_ms);
+    events.add_item(event_kind::state_changed);
+}
+
+void fusb302::establish_hard_reset_recovery() {
+    // Reset the PD logic only (FIFOs, message IDs); the CC configuration
+    // is kept. The source is expected to restore VBUS and send its
+    // capabilities again.
+    write_register(reg_reset, reset_pd_reset);
+    write_command(reg_control1, control1_rx_flush);
+    next_message_id = 0;
+    is_tx_pending = false;
+    is_recovering_from_hard_reset = true;
+
+    set_state(fusb302_state::usb_pd_wait);
+    start_timeout(hard_reset_recovery_ms);
+    events.add_item(event_kind::hard_reset);
+    events.add_item(event_kind::state_changed);
+}
+
+void fusb302::reset_protocol() {
+    write_command(reg_control0, control0_tx_flush);
+    next_message_id = 0;
+    is_tx_pending = false;
 }
 
 void fusb302::establish_usb_20() {
+    set_state(fusb302_state::usb_20);
+    events.add_item(event_kind::state_changed);
+    start_sink();
+}
+
+void fusb302::establish_unattached() {
+    DEBUG_LOG("%lu: Detached\r\n", hal.millis());
+
+    // Reset FUSB302 and restart monitoring CC1 and CC2 (possibly with a different cable)
+    fusb302_state prev_state = state_;
+    init();
+    reset_slice_calibration();
+    is_recovering_from_hard_reset = false;
+    reset_retry_timeouts();
+    is_attaching = false;
+    set_typec_state(typec_state::unattached);
+    // Also reports a detach pending since a retry reset
+    report_attached(false);
+    if (prev_state != state_)
+        events.add_item(event_kind::state_changed);
     start_sink();
 }
 
+void fusb302::set_retry_policy(const fusb302_retry_policy& policy) {
+    retry_policy = policy;
+    reset_retry_timeouts();
+}
+
+void fusb302::reset_retry_timeouts() {
+    pd_wait_ms = retry_policy.pd_wait_ms;
+    num_failures = 0;
+}
+
+void fusb302::set_state(fusb302_state state) {
+    uint32_t now = hal.millis();
+    if (state_ == fusb302_state::usb_pd_wait)
+        retry_stats_.pd_wait_time_ms += now - state_start_time;
+    else if (state_ == fusb302_state::usb_retry_wait)
+        retry_stats_.retry_wait_time_ms += now - state_start_time;
+
+    state_ = state;
+    state_start_time = now;
+}
+
+void fusb302::set_typec_state(typec_state state) {
+    if (state == typec_state_)
+        return;
+
+    if (state == typec_state::attached)
+        report_attached(true);
+    else if (state == typec_state::unattached && state_ != fusb302_state::usb_retry_wait)
+        report_attached(false);
+
+    typec_state_ = state;
+    timers.cancel(cc_debounce_timer);
+    is_cc_debounced = false;
+
+    if (state == typec_state::attach_wait) {
+        timers.start(cc_debounce_timer, cc_debounce_ms);
+    } else if (state == typec_state::attached) {
+        // CC changes are no longer relevant (and frequent during communication)
+        set_register(reg_mask, mask_m_all & ~(mask_m_activity | mask_m_crc_chk | mask_m_vbusok));
+        flush_registers();
+    }
+}
+
+void fusb302::report_attached(bool attached) {
+    if (attached == is_attached_reported)
+        return;
+
+    is_attached_reported = attached;
+    events.add_item(attached ? event_kind::attached : event_kind::detached);
+}
+
+void fusb302::on_typec_change(uint8_t interrupt, uint8_t status0) {
+    bool has_vbus = (status0 & status0_vbusok) != 0;
+
+    if (typec_state_ == typec_state::attached) {
+        // A sink is detached when VBUS is removed (except during a hard reset)
+        if (!has_vbus && !is_recovering_from_hard_reset)
+            establish_unattached();
+
+    } else if (typec_state_ == typec_state::attach_wait) {
+        if ((interrupt & (interrupt_i_bc_lvl | interrupt_i_comp_chng)) != 0) {
+            // CC has changed (e.g. re-plugged): restart debouncing
+            is_cc_debounced = false;
+            timers.start(cc_debounce_timer, cc_debounce_ms);
+        } else if (is_cc_debounced && has_vbus) {
+            set_typec_state(typec_state::attached);
+        }
+    }
+}
+
+void fusb302::on_cc_debounce_timer(void* context) {
+    static_cast<fusb302*>(context)->check_cc_debounced();
+    dispatcher.signal(subsystem::pd_ctrl);
+}
+
+void fusb302::check_cc_debounced() {
+    uint8_t status0;
+    if (!read_registers(reg_status0, 1, &status0)) {
+        // retry shortly
+        timers.start(cc_debounce_timer, 1);
+        return;
+    }
+
+    if ((status0 & status0_bc_lvl_mask) == 0) {
+        // CC has not been stable
+        establish_unattached();
+    } else if ((status0 & status0_vbusok) != 0) {
+        set_typec_state(typec_state::attached);
+    } else {
+        // wait for VBUS interrupt
+        is_cc_debounced = true;
+    }
+}
+
 void fusb302::establish_usb_pd_wait(int cc) {
     // Configure INT_N pin
-    hal.init_int_n();
+    hal.init_int_n(port_);
 
     // Enable automatic retries
-    write_register(reg_control3, control3_auto_retry | control3_3_retries);
-    // Enable interrupts for CC activity and CRC_CHK
-    write_register(reg_mask, mask_m_all & ~(mask_m_activity | mask_m_crc_chk));
+    set_register(reg_control3, control3_auto_retry | control3_3_retries);
+    // Enable interrupts for CC activity, CRC_CHK, VBUS and CC changes
+    set_register(reg_mask, mask_m_all
+                               & ~(mask_m_activity | mask_m_crc_chk | mask_m_vbusok | mask_m_bc_lvl
+                                   | mask_m_comp_chng));
     // Unmask all interrupts (toggle done, hard reset, tx sent etc.)
-    write_register(reg_maska, maska_m_none);
+    set_register(reg_maska, maska_m_none);
     // Enable good CRC sent interrupt
-    write_register(reg_maskb, maskb_m_none);
+    set_register(reg_maskb, maskb_m_none);
     // Enable pull down and CC monitoring
-    write_register(reg_switches0,
+    set_register(reg_switches0,
                    switches0_pdwn1 | switches0_pdwn2 | (cc == 1 ? switches0_meas_cc1 : switches0_meas_cc2));
     // Configure: auto CRC and BMC transmit on CC pin
-    write_register(reg_switches1,
+    set_register(reg_switches1,
                    switches1_specrev_rev_2_0 | switches1_auto_crc | (cc == 1 ? switches1_txcc1 : switches1_txcc2));
     // Enable interrupt
-    write_register(reg_control0, control0_none);
-
-    state_ = fusb302_state::usb_pd_wait;
-    start_timeout(300);
+    set_register(reg_control0, control0_none);
+    flush_registers();
+
+    set_state(fusb302_state::usb_pd_wait);
+    start_timeout(pd_wait_ms);
+    if (!is_attaching) {
+        is_attaching = true;
+        attach_time = state_start_time;
+    }
+    set_typec_state(typec_state::attach_wait);
 }
 
 void fusb302::establish_usb_pd() {
-    state_ = fusb302_state::usb_pd;
+    set_state(fusb302_state::usb_pd);
     cancel_timeout();
+
+    // Success: restart backoff but keep the learned wait time for this source
+    num_failures = 0;
+    is_recovering_from_hard_reset = false;
+    if (is_attaching)
+        retry_stats_.last_time_to_pd_ms = state_start_time - attach_time;
+    is_attaching = false;
     DEBUG_LOG("USB PD comm\r\n", 0);
-    events.add_item(event(event_kind::state_changed));
+    events.add_item(event_kind::state_changed);
+
+    // USB PD communication proves that the source is attached
+    if (typec_state_ == typec_state::attach_wait)
+        set_typec_state(typec_state::attached);
+}
+
+void fusb302::on_timeout_timer(void* context) {
+    // Handled by `poll()` so pending interrupts and messages are processed first
+    static_cast<fusb302*>(context)->is_timeout_expired = true;
+    dispatcher.signal(subsystem::pd_ctrl);
 }
 
 void fusb302::start_timeout(uint32_t ms) {
-    is_timeout_active = true;
-    timeout_expiration = hal.millis() + ms;
+    is_timeout_expired = false;
+    timers.start(timeout_timer, ms);
 }
 
 bool fusb302::has_timeout_expired() {
-    if (!is_timeout_active)
-        return false;
-
-    uint32_t delta = timeout_expiration - hal.millis();
-    if (delta <= 0x8000000)
+    if (!is_timeout_expired)
         return false;
 
-    is_timeout_active = false;
+    is_timeout_expired = false;
     return true;
 }
 
 void fusb302::cancel_timeout() {
-    is_timeout_active = false;
+    timers.cancel(timeout_timer);
+    is_timeout_expired = false;
 }
 
 bool fusb302::has_event() {
@@ -243,19 +809,33 @@ bool fusb302::has_event() {
 }
 
 event fusb302::pop_event() {
-    return events.pop_item();
+    // The payload of the previously consumed message is no longer needed
+    if (consumed_payload != nullptr) {
+        rx_bufs.release(consumed_payload);
+        consumed_payload = nullptr;
+    }
+
+    event evt = events.pop_item();
+    if (evt.kind == event_kind::message_received)
+        consumed_payload = evt.msg_payload;
+    return evt;
 }
 
-uint8_t fusb302::read_message(uint16_t& header, uint8_t* payload) {
+bool fusb302::read_message(uint16_t& header, uint8_t* payload) {
     // Read token and header
     uint8_t buf[3];
-    hal.pd_ctrl_read(reg_fifos, 3, buf);
+    if (!read_registers(reg_fifos, 3, buf)) {
+        // Nothing is known about the FIFO state; retry with the next poll
+        has_pending_rx = true;
+        return false;
+    }
 
     // Check for SOP token
     if ((buf[0] & 0xe0) != 0xe0) {
-        // Flush RX FIFO
-        write_register(reg_control1, control1_rx_flush);
-        return 0;
+        // Malformed frame: flush RX FIFO
+        rx_stats_.invalid_messages++;
+        write_command(reg_control1, control1_rx_flush);
+        return false;
     }
 
     uint8_t* header_buf = reinterpret_cast<uint8_t*>(&header);
@@ -264,9 +844,26 @@ uint8_t fusb302::read_message(uint16_t& header, uint8_t* payload) {
 
     // Get payload and CRC length
     uint8_t len = pd_header::num_data_objs(header) * 4;
-    hal.pd_ctrl_read(reg_fifos, len + 4, payload);
+    if (!read_registers(reg_fifos, len + 4, payload)) {
+        // Rest of message is lost; flush RX FIFO
+        write_command(reg_control1, control1_rx_flush);
+        return false;
+    }
+
+    return true;
+}
+
+void fusb302::on_tx_completed(event_kind kind) {
+    if (!is_tx_pending)
+        return;
 
-    return len;
+    is_tx_pending = false;
+    events.add_item(event(kind, tx_header));
+}
+
+void fusb302::send_hard_reset() {
+    write_command(reg_control3, control3_send_hard_reset);
+    is_tx_pending = false;
 }
 
 void fusb302::send_header_message(pd_msg_type msg_type) {
@@ -276,7 +873,8 @@ void fusb302::send_header_message(pd_msg_type msg_type) {
 
 void fusb302::send_message(uint16_t header, const uint8_t* payload) {
     // Enable internal oscillator
-    write_register(reg_power, power_pwr_all);
+    set_register(reg_power, power_pwr_all);
+    flush_registers();
 
     int payload_len = pd_header::num_data_objs(header) * 4;
     header |= (next_message_id << 9);
@@ -299,7 +897,17 @@ void fusb302::send_message(uint16_t header, const uint8_t* payload) {
     buf[n++] = token_txoff;
     buf[n++] = token_txon;
 
-    hal.pd_ctrl_write(reg_fifos, n, buf);
+    num_transactions++;
+    if (!check_bus_result(hal.pd_ctrl_write(port_, reg_fifos, n, buf))) {
+        // Partially written message must not be sent
+        DEBUG_LOG("TX failed\r\n", 0);
+        write_command(reg_control0, control0_tx_flush);
+        events.add_item(event(event_kind::tx_failed, header));
+        return;
+    }
+
+    is_tx_pending = true;
+    tx_header = header;
 
     next_message_id++;
     if (next_message_id == 8)
@@ -307,17 +915,83 @@ void fusb302::send_message(uint16_t header, const uint8_t* payload) {
 }
 
 uint8_t fusb302::read_register(reg r) {
-    uint8_t val;
-    hal.pd_ctrl_read(r, 1, &val);
+    uint8_t val = 0;
+    read_registers(r, 1, &val);
     return val;
 }
 
-void fusb302::read_registers(reg start_reg, int n, uint8_t* target) {
-    hal.pd_ctrl_read(start_reg, n, target);
+bool fusb302::read_registers(reg start_reg, int n, uint8_t* target) {
+    num_transactions++;
+    return check_bus_result(hal.pd_ctrl_read(port_, start_reg, n, target));
+}
+
+bool fusb302::write_register(reg r, uint8_t value) {
+    num_transactions++;
+    return check_bus_result(hal.pd_ctrl_write(port_, r, 1, &value));
+}
+
+bool fusb302::write_command(reg r, uint8_t command) {
+    // Command bits are self-clearing and thus not stored in the shadow register
+    int index = r - shadow_first_reg;
+    if (!write_register(r, shadow_regs[index] | command))
+        return false;
+
+    // A pending change of the register has been written as well
+    dirty_regs &= ~(1 << index);
+    return true;
+}
+
+bool fusb302::check_bus_result(bool success) {
+    if (success) {
+        consecutive_bus_errors = 0;
+    } else {
+        bus_errors_++;
+        consecutive_bus_errors++;
+    }
+    return success;
 }
 
-void fusb302::write_register(reg r, uint8_t value) {
-    hal.pd_ctrl_write(r, 1, &value);
+void fusb302::set_register(reg r, uint8_t value) {
+    int index = r - shadow_first_reg;
+    if (shadow_regs[index] == value && (dirty_regs & (1 << index)) == 0) {
+        write_stats_.regs_elided++;
+        return;
+    }
+
+    shadow_regs[index] = value;
+    dirty_regs |= 1 << index;
+}
+
+bool fusb302::flush_registers() {
+    int index = 0;
+    while (dirty_regs != 0) {
+        while ((dirty_regs & (1 << index)) == 0)
+            index++;
+
+        // Extend the run over up to `max_bridged_regs` clean registers if more
+        // dirty registers follow. RESET must never be written this way.
+        int start = index;
+        int end = index;
+        for (int i = start + 1; i < num_shadow_regs; i++) {
+            if (shadow_first_reg + i == reg_reset || i - end - 1 > max_bridged_regs)
+                break;
+            if ((dirty_regs & (1 << i)) != 0)
+                end = i;
+        }
+
+        int n = end - start + 1;
+        num_transactions++;
+        if (!check_bus_result(hal.pd_ctrl_write(port_, shadow_first_reg + start, n, shadow_regs + start))) {
+            // Registers remain dirty and will be written by the next flush
+            return false;
+        }
+        dirty_regs &= ~(((1 << n) - 1) << start);
+        write_stats_.regs_written += n;
+        write_stats_.transactions++;
+        index = end + 1;
+    }
+
+    return true;
 }
 
 } // namespace usb_pd
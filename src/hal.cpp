@@ -11,36 +11,298 @@
 #include "hal.h"
 
 #include <libopencmsis/core_cm3.h>
+#include <libopencm3/cm3/cortex.h>
 #include <libopencm3/cm3/nvic.h>
+#include <libopencm3/cm3/scb.h>
 #include <libopencm3/cm3/systick.h>
 #include <libopencm3/stm32/exti.h>
 #include <libopencm3/stm32/gpio.h>
 #include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/timer.h>
 
-#include "i2c_bit_bang.h"
+#if defined(PD_CLOCK_SCALING)
+#include <libopencm3/stm32/flash.h>
+#endif
+
+#if defined(PD_STOP_MODE)
+#include <libopencm3/stm32/pwr.h>
+#include <libopencm3/stm32/rtc.h>
+#endif
+
+#include "dispatcher.h"
+#include "fusb302_regs.h"
+#include "i2c_config.h"
+#include "led_engine.h"
 #include "pd_debug.h"
 
+#if defined(PD_I2C_PROFILE)
+#include "i2c_profiler.h"
+#endif
+
+#if defined(PD_I2C_RECORD)
+#include "i2c_recorder.h"
+#endif
+
+#if defined(PD_I2C_HW)
+#include "i2c_hw.h"
+#elif defined(PD_I2C_TIMER_DMA)
+#include "i2c_timer_dma.h"
+#else
+#include "i2c_bit_bang.h"
+#endif
+
 namespace usb_pd {
 
-constexpr auto fusb302_int_n_port = GPIOA;
-constexpr uint16_t fusb302_int_n_pin = GPIO13;
-constexpr uint8_t fusb302_i2c_addr = 0x22;
+/// Description of the connection to a FUSB302B
+struct pd_port_desc {
+    /// I2C address (0x22 to 0x25, depending on FUSB302B variant)
+    uint8_t i2c_addr;
+    /// GPIO port of INT_N pin
+    uint32_t int_n_port;
+    /// INT_N pin
+    uint16_t int_n_pin;
+};
+
+// All FUSB302B share the I2C bus and thus need different I2C addresses.
+// The INT_N pins must be in the range 4 to 15 (served by EXTI4_15) and
+// have different pin numbers (as they share the EXTI lines).
+// Each port needs its own `pd_sink` (see `pd_sink::pd_sink()`). Example of
+// a second FUSB302B: {0x23, GPIOA, GPIO4} (FUSB302B01MPX, INT_N on PA4).
+static const pd_port_desc pd_ports[] = {
+    {0x22, GPIOA, GPIO13},
+};
+
+constexpr int num_pd_ports = sizeof(pd_ports) / sizeof(pd_ports[0]);
 constexpr uint8_t fusb302_int_n_irq = NVIC_EXTI4_15_IRQ;
-
-constexpr auto led_red_port = GPIOA;
-constexpr uint16_t led_red_pin = GPIO5;
-constexpr auto led_green_port = GPIOA;
-constexpr uint16_t led_green_pin = GPIO6;
-constexpr auto led_blue_port = GPIOA;
-constexpr uint16_t led_blue_pin = GPIO7;
+constexpr int fusb302_max_retries = 2;
 
 constexpr auto button_port = GPIOF;
 constexpr uint16_t button_pin = GPIO1;
 
+#if defined(PD_I2C_HW)
+static i2c_hw i2c;
+#elif defined(PD_I2C_TIMER_DMA)
+static i2c_timer_dma i2c;
+#else
 static i2c_bit_bang i2c;
+#endif
+
+static led_engine led;
 
 static volatile uint32_t millis_count;
 
+// Number of TIM14 overflows (upper bits of microsecond time)
+static volatile uint32_t micros_overflows;
+
+// Time not counted by TIM14 (stop mode, timer restarts; in µs)
+static uint64_t micros_offset;
+
+// Sleep time without SysTick not yet added to `millis_count` (in µs)
+static uint32_t sleep_remainder_us;
+
+// SysTick is only stopped if the next deadline is further away (in µs)
+constexpr uint32_t min_tickless_us = 2000;
+
+#if defined(PD_CLOCK_SCALING)
+
+// Clock is reduced if the PD controller has not been active for this time (in ms)
+constexpr uint32_t clock_idle_ms = 50;
+
+// Time of last PD controller activity (INT_N or I2C transaction)
+static volatile uint32_t last_pd_ctrl_activity;
+
+static void on_pd_ctrl_activity() {
+    last_pd_ctrl_activity = millis_count;
+
+    // In interrupt handlers, the clock has already been increased (see `wait_for_event()`)
+    if (!hal.is_in_interrupt_handler())
+        hal.set_clock_speed(clock_speed::high);
+}
+
+#endif
+
+#if defined(PD_STOP_MODE)
+
+// The RTC is clocked by LSI (nominally 40kHz) and counts in ticks of about 1ms
+constexpr uint32_t rtc_async_prescaler = 40;
+constexpr uint32_t rtc_sync_prescaler = 1000;
+constexpr uint32_t rtc_ticks_per_day = 86400 * rtc_sync_prescaler;
+
+// Minimum number of RTC ticks measured to calibrate the LSI frequency
+// (about 4s; the start and end are not aligned to ticks: error below 1 tick)
+constexpr uint32_t rtc_calibration_ticks = 4096;
+
+// Stop mode is only entered if the next deadline is further away (in µs)
+constexpr uint32_t min_stop_us = 5000;
+
+// Maximum time in stop mode (in µs)
+constexpr uint32_t max_stop_us = 4000000;
+
+// Wake-up ahead of the deadline (covers RTC granularity and clock start-up, in µs)
+constexpr uint32_t stop_wakeup_margin_us = 2000;
+
+// Measured duration of an RTC tick (in 1/256 µs, 0 if not calibrated yet)
+static uint32_t rtc_tick_q8;
+
+// RTC and microsecond time when the calibration started
+static uint32_t rtc_calibration_start_tick;
+static uint64_t rtc_calibration_start_us;
+
+static uint32_t bcd_to_bin(uint32_t bcd) {
+    return (bcd >> 4) * 10 + (bcd & 0x0f);
+}
+
+static uint32_t bin_to_bcd(uint32_t bin) {
+    return ((bin / 10) << 4) | (bin % 10);
+}
+
+// Current RTC time (in ticks since midnight)
+static uint32_t rtc_ticks() {
+    // Shadow registers are bypassed: read until time and subseconds are consistent
+    uint32_t tr;
+    uint32_t ssr;
+    do {
+        tr = RTC_TR;
+        ssr = RTC_SSR;
+    } while (tr != RTC_TR);
+
+    uint32_t seconds = bcd_to_bin((tr >> 16) & 0x3f) * 3600 + bcd_to_bin((tr >> 8) & 0x7f) * 60
+        + bcd_to_bin(tr & 0x7f);
+    return seconds * rtc_sync_prescaler + (rtc_sync_prescaler - 1 - ssr);
+}
+
+static void init_rtc() {
+    rcc_periph_clock_enable(RCC_PWR);
+    pwr_disable_backup_domain_write_protect();
+    rcc_osc_on(RCC_LSI);
+    rcc_wait_for_osc_ready(RCC_LSI);
+
+    // The RTC clock source can only be changed after a backup domain reset
+    if (((RCC_BDCR >> RCC_BDCR_RTCSEL_SHIFT) & RCC_BDCR_RTCSEL_MASK) != RCC_BDCR_RTCSEL_LSI) {
+        RCC_BDCR |= RCC_BDCR_BDRST;
+        RCC_BDCR &= ~RCC_BDCR_BDRST;
+        RCC_BDCR |= RCC_BDCR_RTCSEL_LSI << RCC_BDCR_RTCSEL_SHIFT;
+    }
+    RCC_BDCR |= RCC_BDCR_RTCEN;
+
+    rtc_unlock();
+    RTC_ISR |= RTC_ISR_INIT;
+    while ((RTC_ISR & RTC_ISR_INITF) == 0)
+        ;
+    RTC_PRER = ((rtc_async_prescaler - 1) << RTC_PRER_PREDIV_A_SHIFT) | (rtc_sync_prescaler - 1);
+    RTC_CR |= RTC_CR_BYPSHAD;
+    RTC_ISR &= ~RTC_ISR_INIT;
+    rtc_lock();
+
+    // RTC alarm wakes the MCU from stop mode
+    exti_set_trigger(EXTI17, EXTI_TRIGGER_RISING);
+    exti_enable_request(EXTI17);
+    nvic_enable_irq(NVIC_RTC_IRQ);
+
+    // LSI frequency varies between 30 and 50kHz: the tick duration is measured
+    // with TIM14 in the background (see `calibrate_rtc()`)
+    rtc_tick_q8 = 0;
+    rtc_calibration_start_tick = rtc_ticks();
+    rtc_calibration_start_us = hal.micros();
+}
+
+// Completes the LSI calibration; returns `false` if not enough time has passed since `init_rtc()`
+static bool calibrate_rtc() {
+    if (rtc_tick_q8 != 0)
+        return true;
+
+    uint32_t ticks = (rtc_ticks() + rtc_ticks_per_day - rtc_calibration_start_tick) % rtc_ticks_per_day;
+    if (ticks < rtc_calibration_ticks)
+        return false;
+
+    uint64_t duration_us = hal.micros() - rtc_calibration_start_us;
+    rtc_tick_q8 = static_cast<uint32_t>((duration_us << 8) / ticks);
+    return true;
+}
+
+static void set_rtc_alarm(uint32_t tick) {
+    tick %= rtc_ticks_per_day;
+    uint32_t seconds = tick / rtc_sync_prescaler;
+    uint32_t subseconds = rtc_sync_prescaler - 1 - tick % rtc_sync_prescaler;
+
+    rtc_unlock();
+    RTC_CR &= ~(RTC_CR_ALRAE | RTC_CR_ALRAIE);
+    while ((RTC_ISR & RTC_ISR_ALRAWF) == 0)
+        ;
+
+    // Match hours, minutes, seconds and the subsecond bits 0 to 9 (but not the date)
+    RTC_ALRMAR = RTC_ALRMXR_MSK4 | (bin_to_bcd(seconds / 3600) << 16) | (bin_to_bcd(seconds / 60 % 60) << 8)
+        | bin_to_bcd(seconds % 60);
+    RTC_ALRMASSR = (10 << RTC_ALRMXSSR_MASKSS_SHIFT) | subseconds;
+    RTC_ISR &= ~RTC_ISR_ALRAF;
+    RTC_CR |= RTC_CR_ALRAE | RTC_CR_ALRAIE;
+    rtc_lock();
+}
+
+static void clear_rtc_alarm() {
+    rtc_unlock();
+    RTC_CR &= ~(RTC_CR_ALRAE | RTC_CR_ALRAIE);
+    rtc_lock();
+    RTC_ISR &= ~RTC_ISR_ALRAF;
+    exti_reset_request(EXTI17);
+}
+
+#endif
+
+#if defined(PD_ISR_RX)
+
+// The INT_N handler talks to the PD controller. The I2C code waits for
+// the DMA, I2C and SysTick interrupts, so they must be able to preempt it.
+constexpr uint8_t fusb302_int_n_priority = 0x80;
+
+static int_n_handler int_n_handlers[num_pd_ports];
+static void* int_n_contexts[num_pd_ports];
+
+// Indicates if an I2C transaction is in progress (in the main loop)
+static volatile bool is_i2c_busy;
+
+// INT_N pins (EXTI bit mask) whose handlers have been deferred or triggered
+static volatile uint32_t pending_int_n;
+
+static void begin_i2c_transaction() {
+    is_i2c_busy = true;
+}
+
+static void end_i2c_transaction() {
+    is_i2c_busy = false;
+
+    // run deferred handlers
+    if (pending_int_n != 0)
+        nvic_set_pending_irq(fusb302_int_n_irq);
+}
+
+#endif
+
+#if defined(PD_I2C_PROFILE)
+
+static i2c_profiler profiler;
+
+static void profile_transaction(uint8_t reg, int data_len, uint32_t start_us) {
+    uint32_t duration = static_cast<uint32_t>(hal.micros()) - start_us;
+    profiler.record(static_cast<usb_pd::reg>(reg), data_len, duration);
+}
+
+i2c_profiler& mcu_hal::pd_ctrl_profiler() {
+    return profiler;
+}
+
+#endif
+
+#if defined(PD_I2C_RECORD)
+
+static i2c_recorder recorder;
+
+i2c_recorder& mcu_hal::pd_ctrl_recorder() {
+    return recorder;
+}
+
+#endif
+
 void mcu_hal::init() {
     rcc_clock_setup_in_hsi_out_48mhz();
 
@@ -54,95 +316,317 @@ void mcu_hal::init() {
     systick_clear();
     systick_counter_enable();
 
+    // Initialize microsecond timer (free-running, extended by overflow interrupt)
+    rcc_periph_clock_enable(RCC_TIM14);
+    timer_set_prescaler(TIM14, rcc_apb1_frequency / 1000000 - 1);
+    timer_set_period(TIM14, 0xffff);
+    timer_generate_event(TIM14, TIM_EGR_UG); // load prescaler
+    timer_clear_flag(TIM14, TIM_SR_UIF);
+    micros_overflows = 0;
+    micros_offset = 0;
+    timer_enable_irq(TIM14, TIM_DIER_UIE);
+    nvic_enable_irq(NVIC_TIM14_IRQ);
+    timer_enable_counter(TIM14);
+
+#if defined(PD_STOP_MODE)
+    init_rtc();
+#endif
+
     DEBUG_INIT();
 
     // Initialize LED
-    gpio_mode_setup(led_red_port, GPIO_MODE_OUTPUT, GPIO_PUPD_NONE, led_red_pin);
-    gpio_mode_setup(led_green_port, GPIO_MODE_OUTPUT, GPIO_PUPD_NONE, led_green_pin);
-    gpio_mode_setup(led_blue_port, GPIO_MODE_OUTPUT, GPIO_PUPD_NONE, led_blue_pin);
+    led.init();
     set_led(color::off);
 
     i2c.init();
+    i2c_stats_ = {};
+#if defined(PD_I2C_PROFILE)
+    profiler.reset();
+#endif
+#if defined(PD_I2C_RECORD)
+    recorder.reset();
+#endif
 
     // Initialize button
     gpio_mode_setup(button_port, GPIO_MODE_INPUT, GPIO_PUPD_PULLUP, button_pin);
+    // button changes are signaled by interrupt (and wake the MCU from stop mode)
+    exti_select_source(EXTI1, button_port);
+    exti_set_trigger(EXTI1, EXTI_TRIGGER_BOTH);
+    exti_enable_request(EXTI1);
+    nvic_enable_irq(NVIC_EXTI0_1_IRQ);
     is_button_down = false;
     last_button_change_time = 0;
     button_has_been_pressed = false;
+
+#if defined(PD_CLOCK_SCALING)
+    clock_speed_ = clock_speed::high;
+    last_pd_ctrl_activity = 0;
+#endif
+}
+
+#if defined(PD_CLOCK_SCALING)
+
+void mcu_hal::set_clock_speed(clock_speed speed) {
+    if (speed == clock_speed_)
+        return;
+
+    // Interrupts are masked until all clock dependent peripherals have been reconfigured
+    uint32_t primask = cm_mask_interrupts(1);
+    uint64_t now = micros();
+#if defined(PD_DEBUG)
+    debug_begin_clock_change();
+#endif
+
+    if (speed == clock_speed::high) {
+        rcc_clock_setup_in_hsi_out_48mhz();
+    } else {
+        rcc_set_sysclk_source(RCC_HSI);
+        rcc_wait_for_sysclk_status(RCC_HSI);
+        rcc_osc_off(RCC_PLL);
+        rcc_set_hpre(RCC_CFGR_HPRE_NODIV);
+        rcc_set_ppre(RCC_CFGR_PPRE_NODIV);
+        flash_set_ws(FLASH_ACR_LATENCY_000_024MHZ);
+        rcc_ahb_frequency = 8000000;
+        rcc_apb1_frequency = 8000000;
+    }
+    clock_speed_ = speed;
+
+    // Restart SysTick (the current ms is slightly extended or shortened)
+    systick_set_reload(rcc_ahb_frequency / 1000 - 1);
+    systick_clear();
+
+    // Restart microsecond timer with new prescaler; the time continues from `now`
+    timer_set_prescaler(TIM14, rcc_apb1_frequency / 1000000 - 1);
+    timer_generate_event(TIM14, TIM_EGR_UG);
+    timer_clear_flag(TIM14, TIM_SR_UIF);
+    nvic_clear_pending_irq(NVIC_TIM14_IRQ);
+    micros_overflows = 0;
+    micros_offset = now;
+
+    i2c.update_clock();
+    led.update_clock();
+#if defined(PD_DEBUG)
+    debug_end_clock_change();
+#endif
+    cm_mask_interrupts(primask);
+}
+
+#endif
+
+int mcu_hal::num_pd_ctrls() {
+    return num_pd_ports;
 }
 
-void mcu_hal::init_int_n() {
+void mcu_hal::init_int_n(int port) {
+    const pd_port_desc& desc = pd_ports[port];
+
     // configure FUSB302 interrupt line
-    gpio_mode_setup(fusb302_int_n_port, GPIO_MODE_INPUT, GPIO_PUPD_NONE, fusb302_int_n_pin);
+    gpio_mode_setup(desc.int_n_port, GPIO_MODE_INPUT, GPIO_PUPD_NONE, desc.int_n_pin);
+
+    enable_int_n_wakeup(port);
+}
+
+void mcu_hal::enable_int_n_wakeup(int port) {
+    const pd_port_desc& desc = pd_ports[port];
 
     // enable interrupt (so the MCU wakes)
-	nvic_enable_irq(fusb302_int_n_irq);
-    uint32_t exti = fusb302_int_n_pin; // EXIT and GPIO use same bit mask
-    exti_select_source(exti, fusb302_int_n_port);
+#if defined(PD_ISR_RX)
+    nvic_set_priority(fusb302_int_n_irq, fusb302_int_n_priority);
+#endif
+    nvic_enable_irq(fusb302_int_n_irq);
+    uint32_t exti = desc.int_n_pin; // EXIT and GPIO use same bit mask
+    exti_select_source(exti, desc.int_n_port);
     exti_set_trigger(exti, EXTI_TRIGGER_FALLING);
     exti_enable_request(exti);
 }
 
+#if defined(PD_ISR_RX)
+
+void mcu_hal::set_int_n_handler(int port, int_n_handler handler, void* context) {
+    int_n_contexts[port] = context;
+    int_n_handlers[port] = handler;
+}
+
+void mcu_hal::trigger_int_n_handler(int port) {
+    cm_disable_interrupts();
+    pending_int_n |= pd_ports[port].int_n_pin;
+    cm_enable_interrupts();
+    nvic_set_pending_irq(fusb302_int_n_irq);
+}
+
+void mcu_hal::disable_interrupts() {
+    cm_disable_interrupts();
+}
+
+void mcu_hal::enable_interrupts() {
+    cm_enable_interrupts();
+}
+
+#endif
+
 extern "C" void exti4_15_isr(void) {
-    uint32_t exti = fusb302_int_n_pin; // EXIT and GPIO use same bit mask
-	exti_reset_request(exti);
+    uint32_t exti = 0;
+    for (int i = 0; i < num_pd_ports; i++)
+        exti |= pd_ports[i].int_n_pin; // EXIT and GPIO use same bit mask
+
+#if defined(PD_CLOCK_SCALING)
+    // PD traffic is expected (the clock is not changed here)
+    on_pd_ctrl_activity();
+#endif
+
+#if defined(PD_ISR_RX)
+    uint32_t pending = exti_get_flag_status(exti) | pending_int_n;
+    exti_reset_request(exti);
+
+    // I2C bus is in use: run handler when the transaction has completed
+    if (is_i2c_busy) {
+        pending_int_n = pending;
+        return;
+    }
 
-    // nothing to do; just used to wake up MCU
+    pending_int_n = 0;
+    for (int i = 0; i < num_pd_ports; i++) {
+        if ((pending & pd_ports[i].int_n_pin) != 0 && int_n_handlers[i] != nullptr)
+            int_n_handlers[i](int_n_contexts[i]);
+    }
+#else
+    exti_reset_request(exti);
+#endif
+
+    dispatcher.signal(subsystem::pd_ctrl);
 }
 
-void mcu_hal::pd_ctrl_read(uint8_t reg, int data_len, uint8_t* data) {
-    bool ack = i2c.read_data(fusb302_i2c_addr, reg, data_len, data);
-    if (!ack)
+bool mcu_hal::pd_ctrl_read(int port, uint8_t reg, int data_len, uint8_t* data) {
+#if defined(PD_CLOCK_SCALING)
+    on_pd_ctrl_activity();
+#endif
+#if defined(PD_ISR_RX)
+    begin_i2c_transaction();
+#endif
+
+    bool ack;
+    for (int attempt = 0;; attempt++) {
+#if defined(PD_I2C_PROFILE)
+        uint32_t start_us = static_cast<uint32_t>(micros());
+        ack = i2c.read_data(pd_ports[port].i2c_addr, reg, data_len, data);
+        profile_transaction(reg, data_len, start_us);
+#else
+        ack = i2c.read_data(pd_ports[port].i2c_addr, reg, data_len, data);
+#endif
+        if (ack)
+            break;
         DEBUG_LOG("NACK read %d\r\n", reg);
+        if (!recover_pd_ctrl_bus(attempt, fusb302_max_retries))
+            break;
+    }
+
+#if defined(PD_I2C_RECORD)
+    // The recorder is not safe in interrupt handlers
+    if (!is_in_interrupt_handler())
+        recorder.record(port, false, reg, ack, data_len, data, static_cast<uint32_t>(micros()));
+#endif
+#if defined(PD_ISR_RX)
+    end_i2c_transaction();
+#endif
+    return ack;
 }
 
-void mcu_hal::pd_ctrl_write(uint8_t reg, int data_len, const uint8_t* data, bool end_with_stop) {
-    bool ack = i2c.write_data(fusb302_i2c_addr, reg, data_len, data, end_with_stop);
-    if (!ack)
+bool mcu_hal::pd_ctrl_write(int port, uint8_t reg, int data_len, const uint8_t* data, bool end_with_stop) {
+    // FIFO writes are not idempotent: the caller must flush the FIFO and resend
+    int max_retries = reg == reg_fifos ? 0 : fusb302_max_retries;
+
+#if defined(PD_CLOCK_SCALING)
+    on_pd_ctrl_activity();
+#endif
+#if defined(PD_ISR_RX)
+    begin_i2c_transaction();
+#endif
+
+    bool ack;
+    for (int attempt = 0;; attempt++) {
+#if defined(PD_I2C_PROFILE)
+        uint32_t start_us = static_cast<uint32_t>(micros());
+        ack = i2c.write_data(pd_ports[port].i2c_addr, reg, data_len, data, end_with_stop);
+        profile_transaction(reg, data_len, start_us);
+#else
+        ack = i2c.write_data(pd_ports[port].i2c_addr, reg, data_len, data, end_with_stop);
+#endif
+        if (ack)
+            break;
         DEBUG_LOG("NACK write %d\r\n", reg);
-}
+        if (!recover_pd_ctrl_bus(attempt, max_retries))
+            break;
+    }
 
-bool mcu_hal::is_interrupt_asserted() {
-    return gpio_get(fusb302_int_n_port, fusb302_int_n_pin) == 0;
+#if defined(PD_I2C_RECORD)
+    if (!is_in_interrupt_handler())
+        recorder.record(port, true, reg, ack, data_len, data, static_cast<uint32_t>(micros()));
+#endif
+#if defined(PD_ISR_RX)
+    end_i2c_transaction();
+#endif
+    return ack;
 }
 
-void mcu_hal::set_led(color c, uint32_t on, uint32_t off) {
-    uint8_t cv = static_cast<uint8_t>(c);
+bool mcu_hal::recover_pd_ctrl_bus(int attempt, int max_retries) {
+    i2c_stats_.errors++;
 
-    if ((cv & 0b100) != 0)
-        gpio_set(led_red_port, led_red_pin);
-    else
-        gpio_clear(led_red_port, led_red_pin);
+    i2c.recover_bus();
+    i2c_stats_.recoveries++;
 
-    if ((cv & 0b010) != 0)
-        gpio_set(led_green_port, led_green_pin);
-    else
-        gpio_clear(led_green_port, led_green_pin);
+    if (attempt >= max_retries) {
+        i2c_stats_.failures++;
+        return false;
+    }
 
-    if ((cv & 0b001) != 0)
-        gpio_set(led_blue_port, led_blue_pin);
-    else
-        gpio_clear(led_blue_port, led_blue_pin);
+    i2c_stats_.retries++;
+    return true;
+}
+
+bool mcu_hal::is_interrupt_asserted(int port) {
+    const pd_port_desc& desc = pd_ports[port];
+    return gpio_get(desc.int_n_port, desc.int_n_pin) == 0;
+}
+
+void mcu_hal::set_led(color c, uint32_t on, uint32_t off) {
+    // bits of `color` are set if the LED is off
+    uint8_t cv = static_cast<uint8_t>(c);
+    rgb_color rgb;
+    rgb.red = (cv & 0b100) != 0 ? 0 : 255;
+    rgb.green = (cv & 0b010) != 0 ? 0 : 255;
+    rgb.blue = (cv & 0b001) != 0 ? 0 : 255;
+    set_led(rgb, on, off);
+}
 
+void mcu_hal::set_led(rgb_color c, uint32_t on, uint32_t off) {
     led_color = c;
     led_on = on;
     led_off = off;
     is_led_on = true;
-    led_timeout = millis() + (off != 0 ? on : 0x7fffffff);
+    timers.cancel(led_timer);
+
+    if (off == 0) {
+        led.show(c);
+    } else if (!led.flash(c, on, off)) {
+        // flash pattern is not supported by the timer: toggle LED by software
+        led.show(c);
+        timers.start(led_timer, on);
+    }
 }
 
-void mcu_hal::update_led() {
-    if (!has_expired(led_timeout))
-        return;
+void mcu_hal::on_led_timer(void* context) {
+    static_cast<mcu_hal*>(context)->update_led();
+}
 
-    if (is_led_on && led_off != 0) {
-        gpio_set(led_red_port, led_red_pin);
-        gpio_set(led_green_port, led_green_pin);
-        gpio_set(led_blue_port, led_blue_pin);
+void mcu_hal::update_led() {
+    if (is_led_on) {
+        led.show(rgb_color{0, 0, 0});
         is_led_on = false;
-        led_timeout += led_off;
+        timers.start(led_timer, led_off);
     } else {
-        set_led(led_color, led_on, led_off);
+        led.show(led_color);
+        is_led_on = true;
+        timers.start(led_timer, led_on);
     }
 }
 
@@ -163,9 +647,7 @@ bool mcu_hal::is_long_press() {
     return is_button_down && (millis() - last_button_change_time) > 700;
 }
 
-void mcu_hal::poll() {
-    update_led();
-
+void mcu_hal::poll_button() {
     // check for button change
     bool is_down = gpio_get(button_port, button_pin) == 0;
 
@@ -181,13 +663,159 @@ void mcu_hal::poll() {
 }
 
 void mcu_hal::wait_for_event() {
+    // Interrupts are disabled so no event can be signaled between checking
+    // and going to sleep. A pending interrupt still wakes the MCU.
+    cm_disable_interrupts();
+
+    if (!dispatcher.has_pending_work()) {
+#if defined(PD_CLOCK_SCALING)
+        if (clock_speed_ == clock_speed::high && millis_count - last_pd_ctrl_activity >= clock_idle_ms)
+            set_clock_speed(clock_speed::low);
+#endif
+
+        uint64_t deadline = timers.next_deadline();
+        uint64_t now = micros();
+        if (deadline <= now + min_tickless_us) {
+            __WFI();
+#if defined(PD_STOP_MODE)
+        } else if (deadline > now + min_stop_us && can_stop()) {
+            uint64_t duration = deadline - now;
+            stop(duration < max_stop_us ? static_cast<uint32_t>(duration) : max_stop_us);
+#endif
+        } else {
+            sleep_without_tick(deadline, now);
+        }
+
+#if defined(PD_CLOCK_SCALING)
+        // Woken by INT_N: increase the clock before its interrupt handler runs
+        if (nvic_get_pending_irq(fusb302_int_n_irq))
+            on_pd_ctrl_activity();
+#endif
+    }
+
+    cm_enable_interrupts();
+}
+
+void mcu_hal::sleep_without_tick(uint64_t deadline, uint64_t now) {
+    // Called with interrupts disabled. Stop SysTick and keep the part
+    // of the current millisecond that has already elapsed.
+    systick_counter_disable();
+    sleep_remainder_us += (systick_get_reload() - systick_get_value()) / (rcc_ahb_frequency / 1000000);
+
+    // Wake up at the deadline with a TIM14 compare event. If it is further away,
+    // the TIM14 overflow wakes the MCU (every 65ms) and the main loop sleeps again.
+    if (deadline - now <= 0xffff) {
+        timer_set_oc_value(TIM14, TIM_OC1, static_cast<uint16_t>(deadline - micros_offset));
+        timer_clear_flag(TIM14, TIM_SR_CC1IF);
+        timer_enable_irq(TIM14, TIM_DIER_CC1IE);
+    }
+
     __WFI();
+
+    timer_disable_irq(TIM14, TIM_DIER_CC1IE);
+    timer_clear_flag(TIM14, TIM_SR_CC1IF);
+
+    // Advance time by the time slept and restart SysTick
+    uint64_t wakeup = micros();
+    sleep_remainder_us += static_cast<uint32_t>(wakeup - now);
+    millis_count += sleep_remainder_us / 1000;
+    sleep_remainder_us %= 1000;
+    systick_clear();
+    systick_counter_enable();
+
+    if (timers.next_deadline() <= wakeup)
+        dispatcher.signal(subsystem::timer);
 }
 
+#if defined(PD_STOP_MODE)
+
+bool mcu_hal::can_stop() {
+    // Button press duration is measured with SysTick
+    if (is_button_down)
+        return false;
+
+    // LED timer does not run in stop mode
+    if (led.is_running())
+        return false;
+
+#if defined(PD_DEBUG)
+    // UART does not run in stop mode
+    if (!debug_is_tx_idle())
+        return false;
+#endif
+
+    // The RTC alarm requires the calibrated LSI frequency
+    return calibrate_rtc();
+}
+
+void mcu_hal::stop(uint32_t duration_us) {
+    uint32_t ticks = ((duration_us - stop_wakeup_margin_us) << 8) / rtc_tick_q8;
+
+    // Called with interrupts disabled; they remain disabled until the clock and
+    // the time have been restored. A pending interrupt still wakes the MCU.
+    uint32_t start_tick = rtc_ticks();
+    set_rtc_alarm(start_tick + ticks);
+
+    // The alarm only matches the exact time: it must not have passed already
+    if ((rtc_ticks() + rtc_ticks_per_day - start_tick) % rtc_ticks_per_day >= ticks) {
+        clear_rtc_alarm();
+        return;
+    }
+
+    pwr_set_stop_mode();
+    pwr_voltage_regulator_low_power_in_stop();
+    SCB_SCR |= SCB_SCR_SLEEPDEEP;
+    __WFI();
+    SCB_SCR &= ~SCB_SCR_SLEEPDEEP;
+
+    // MCU runs on HSI (8MHz) after stop mode: restart PLL
+#if defined(PD_CLOCK_SCALING)
+    if (clock_speed_ == clock_speed::high)
+        rcc_clock_setup_in_hsi_out_48mhz();
+#else
+    rcc_clock_setup_in_hsi_out_48mhz();
+#endif
+
+    uint32_t elapsed_ticks = (rtc_ticks() + rtc_ticks_per_day - start_tick) % rtc_ticks_per_day;
+    clear_rtc_alarm();
+
+    // Advance time by the time spent in stop mode
+    uint32_t elapsed_us = (elapsed_ticks * rtc_tick_q8) >> 8;
+    micros_offset += elapsed_us;
+    sleep_remainder_us += elapsed_us;
+    millis_count += sleep_remainder_us / 1000;
+    sleep_remainder_us %= 1000;
+
+    dispatcher.signal(subsystem::timer);
+}
+
+#endif
+
 uint32_t mcu_hal::millis() {
     return millis_count;
 }
 
+uint64_t mcu_hal::micros() {
+    // Interrupts are masked so the overflow interrupt cannot intervene.
+    // If called with interrupts disabled, a pending overflow is accounted for.
+    uint32_t primask = cm_mask_interrupts(1);
+    uint32_t overflows = micros_overflows;
+    uint32_t count = timer_get_counter(TIM14);
+    if (timer_get_flag(TIM14, TIM_SR_UIF)) {
+        // counter has wrapped around but the overflow has not been counted yet
+        count = timer_get_counter(TIM14);
+        overflows++;
+    }
+    uint64_t offset = micros_offset;
+    cm_mask_interrupts(primask);
+
+    return ((static_cast<uint64_t>(overflows) << 16) | count) + offset;
+}
+
+bool mcu_hal::is_in_interrupt_handler() {
+    return (SCB_ICSR & SCB_ICSR_VECTACTIVE) != 0;
+}
+
 void mcu_hal::delay(uint32_t ms) {
     int32_t target_time = millis_count + ms;
     while (target_time - (int32_t)millis_count > 0)
@@ -203,4 +831,34 @@ bool mcu_hal::has_expired(uint32_t timeout) {
 // System tick timer interrupt handler
 extern "C" void sys_tick_handler() {
     usb_pd::millis_count++;
+
+    if (usb_pd::timers.is_due(usb_pd::hal.micros()))
+        usb_pd::dispatcher.signal(usb_pd::subsystem::timer);
+}
+
+#if defined(PD_STOP_MODE)
+
+// RTC alarm interrupt handler
+extern "C" void rtc_isr() {
+    RTC_ISR &= ~RTC_ISR_ALRAF;
+    exti_reset_request(EXTI17);
+
+    // nothing to do; just used to wake up MCU
+}
+
+#endif
+
+// Button interrupt handler
+extern "C" void exti0_1_isr() {
+    exti_reset_request(EXTI1);
+    usb_pd::dispatcher.signal(usb_pd::subsystem::button);
+}
+
+// Microsecond timer overflow interrupt handler (the compare event
+// only wakes the MCU and is cleared by `sleep_without_tick()`)
+extern "C" void tim14_isr() {
+    if (timer_get_flag(TIM14, TIM_SR_UIF)) {
+        timer_clear_flag(TIM14, TIM_SR_UIF);
+        usb_pd::micros_overflows++;
+    }
 }
@@ -11,8 +11,38 @@
 
 #include <libopencm3/stm32/rcc.h>
 
+#include "pd_debug.h"
+
 namespace usb_pd {
 
+static_assert(scl_port == sda_port, "SCL and SDA are expected on the same port");
+
+// Delay, bit and byte functions are inlined and unrolled so the timing
+// is only determined by the calibrated delay loop.
+
+inline __attribute__((always_inline)) void i2c_bit_bang::delay() {
+    uint32_t n = delay_loops;
+    asm volatile("1: subs %0, #1\n\tbne 1b" : "+l"(n) : : "cc");
+}
+
+inline __attribute__((always_inline)) void i2c_bit_bang::write_bit(bool bit) {
+    GPIO_BSRR(sda_port) = bit ? sda_pin : static_cast<uint32_t>(sda_pin) << 16;
+    delay();
+    set_scl();
+    delay();
+    clear_scl();
+}
+
+inline __attribute__((always_inline)) bool i2c_bit_bang::read_bit() {
+    set_sda();
+    delay();
+    set_scl();
+    delay();
+    bool bit = read_sda();
+    clear_scl();
+    return bit;
+}
+
 void i2c_bit_bang::init() {
     // SCL is driven high and low as the board has no pull-up resistor.
     // Therefore, clock stretching is not supported.
@@ -24,6 +54,15 @@ void i2c_bit_bang::init() {
     gpio_clear(sda_port, sda_pin);
     gpio_mode_setup(sda_port, GPIO_MODE_OUTPUT, GPIO_PUPD_PULLDOWN, sda_pin);
     gpio_set_output_options(sda_port, GPIO_OTYPE_OD, GPIO_OSPEED_50MHZ, sda_pin);
+
+    update_clock();
+    DEBUG_LOG("I2C SCL period: %lu ns\r\n",
+              i2c_bit_bang_timing::scl_period_ns(rcc_ahb_frequency, PD_I2C_SPEED_KHZ * 1000));
+}
+
+void i2c_bit_bang::update_clock() {
+    // rcc_ahb_frequency is only known at run-time
+    delay_loops = i2c_bit_bang_timing::delay_loops(rcc_ahb_frequency, PD_I2C_SPEED_KHZ * 1000);
 }
 
 bool i2c_bit_bang::write_data(uint8_t addr, uint8_t reg, int data_len, const uint8_t* data, bool end_with_stop) {
@@ -33,24 +72,40 @@ bool i2c_bit_bang::write_data(uint8_t addr, uint8_t reg, int data_len, const uin
     for (int i = 0; i < data_len; i++) {
         ack = ack && write_byte(data[i]);
     }
-    if (end_with_stop && !ack)
+    if (end_with_stop || !ack)
         write_stop_cond();
     return ack;
 }
 
 bool i2c_bit_bang::read_data(uint8_t addr, uint8_t reg, int data_len, uint8_t* data) {
-    bool ack = write_data(addr, reg, 0, nullptr, false);
+    // STOP condition has already been written if it fails
+    if (!write_data(addr, reg, 0, nullptr, false))
+        return false;
 
-    if (ack)
-        write_start_cond();
-    ack = ack && write_byte((addr << 1) | 1);
+    write_start_cond();
+    bool ack = write_byte((addr << 1) | 1);
     for (int i = 0; i < data_len; i++) {
-        data[i] = read_byte(i == data_len - 1);
+        data[i] = ack ? read_byte(i == data_len - 1) : 0;
     }
     write_stop_cond();
     return ack;
 }
 
+void i2c_bit_bang::recover_bus() {
+    // release SDA and clock out remaining bits (at most 9 clock cycles)
+    set_sda();
+    for (int i = 0; i < 9 && !read_sda(); i++) {
+        clear_scl();
+        delay();
+        set_scl();
+        delay();
+    }
+
+    clear_scl();
+    delay();
+    write_stop_cond();
+}
+
 void i2c_bit_bang::write_start_cond() {
     if (is_started) {
         set_sda();
@@ -76,52 +131,32 @@ void i2c_bit_bang::write_stop_cond() {
 }
 
 bool i2c_bit_bang::write_byte(uint8_t value) {
-    for (int i = 0; i < 8; i++) {
-        write_bit((value & 0x80) != 0);
-        value <<= 1;
-    }
+    write_bit((value & 0x80) != 0);
+    write_bit((value & 0x40) != 0);
+    write_bit((value & 0x20) != 0);
+    write_bit((value & 0x10) != 0);
+    write_bit((value & 0x08) != 0);
+    write_bit((value & 0x04) != 0);
+    write_bit((value & 0x02) != 0);
+    write_bit((value & 0x01) != 0);
 
     return !read_bit();
 }
 
 uint8_t i2c_bit_bang::read_byte(bool nack) {
     uint8_t value = 0;
-    for (int i = 0; i < 8; i++) {
-        value <<= 1;
-        value |= read_bit();
-    }
+    value |= read_bit() << 7;
+    value |= read_bit() << 6;
+    value |= read_bit() << 5;
+    value |= read_bit() << 4;
+    value |= read_bit() << 3;
+    value |= read_bit() << 2;
+    value |= read_bit() << 1;
+    value |= read_bit() << 0;
 
     write_bit(nack);
 
     return value;
 }
 
-void i2c_bit_bang::write_bit(bool bit) {
-    if (bit) {
-        set_sda();
-    } else {
-        clear_sda();
-    }
-    delay();
-    set_scl();
-    delay();
-    clear_scl();
-}
-
-bool i2c_bit_bang::read_bit() {
-    set_sda();
-    delay();
-    set_scl();
-    delay();
-    bool bit = read_sda();
-    clear_scl();
-    return bit;
-}
-
-void i2c_bit_bang::delay() {
-    for (int i = 10; i > 0; i--) {
-        asm("nop");
-    }
-}
-
 } // namespace usb_pd
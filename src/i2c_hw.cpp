@@ -0,0 +1,292 @@
+//
+// USB Power Delivery Sink Using FUSB302B
+// Copyright (c) 2020 Manuel Bleichenbacher
+//
+// Licensed under MIT License
+// https://opensource.org/licenses/MIT
+//
+// I2C using the I2C1 peripheral and DMA
+//
+
+#include "i2c_hw.h"
+
+#if defined(PD_I2C_HW)
+
+#include <libopencm3/cm3/cortex.h>
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/stm32/dma.h>
+#include <libopencm3/stm32/gpio.h>
+#include <libopencm3/stm32/i2c.h>
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/syscfg.h>
+#include <libopencmsis/core_cm3.h>
+
+#include "i2c_config.h"
+
+namespace usb_pd {
+
+constexpr auto i2c_port = GPIOA;
+constexpr uint16_t i2c_scl_pin = GPIO9;
+constexpr uint16_t i2c_sda_pin = GPIO10;
+
+constexpr uint8_t tx_dma_channel = DMA_CHANNEL2;
+constexpr uint8_t rx_dma_channel = DMA_CHANNEL3;
+
+// Data of this length or longer is transferred using DMA
+constexpr int min_dma_len = 4;
+
+// Maximum number of status checks when busy waiting (about 2ms)
+constexpr int max_polls = 10000;
+// Maximum number of wake-ups when sleeping (SYSTICK wakes the MCU every 1ms)
+constexpr int max_sleeps = 10;
+
+constexpr uint32_t error_flags = I2C_ISR_NACKF | I2C_ISR_BERR | I2C_ISR_ARLO;
+constexpr uint32_t interrupt_enables = I2C_CR1_TCIE | I2C_CR1_STOPIE | I2C_CR1_NACKIE | I2C_CR1_ERRIE;
+
+#if PD_I2C_SPEED_KHZ == 100
+constexpr auto i2c_speed = i2c_speed_sm_100k;
+#elif PD_I2C_SPEED_KHZ == 400
+constexpr auto i2c_speed = i2c_speed_fm_400k;
+#else
+constexpr auto i2c_speed = i2c_speed_fmp_1m;
+#endif
+
+// Bus recovery is bit banged in standard mode
+constexpr uint32_t recovery_bus_freq = 100000;
+
+static void init_dma_channel(uint8_t channel, volatile uint32_t* data_reg) {
+    dma_channel_reset(DMA1, channel);
+    dma_set_priority(DMA1, channel, DMA_CCR_PL_HIGH);
+    dma_set_memory_size(DMA1, channel, DMA_CCR_MSIZE_8BIT);
+    dma_set_peripheral_size(DMA1, channel, DMA_CCR_PSIZE_8BIT);
+    dma_enable_memory_increment_mode(DMA1, channel);
+    dma_set_peripheral_address(DMA1, channel, (uint32_t)data_reg);
+}
+
+void i2c_hw::init() {
+    rcc_periph_clock_enable(RCC_GPIOA);
+    rcc_periph_clock_enable(RCC_DMA1);
+    rcc_periph_clock_enable(RCC_I2C1);
+
+    // I2C1 is clocked by HSI (8MHz), independent of the system clock
+    rcc_set_i2c_clock_hsi(I2C1);
+
+#if PD_I2C_SPEED_KHZ == 1000
+    // Fast mode plus requires the high current drive of the pins
+    rcc_periph_clock_enable(RCC_SYSCFG_COMP);
+    SYSCFG_CFGR1 |= SYSCFG_CFGR1_I2C_FMP_PA9 | SYSCFG_CFGR1_I2C_FMP_PA10;
+#endif
+
+    // External pull-ups are required (see header); the internal ones only help with idle levels
+    gpio_mode_setup(i2c_port, GPIO_MODE_AF, GPIO_PUPD_PULLUP, i2c_scl_pin | i2c_sda_pin);
+    gpio_set_output_options(i2c_port, GPIO_OTYPE_OD, GPIO_OSPEED_50MHZ, i2c_scl_pin | i2c_sda_pin);
+    gpio_set_af(i2c_port, GPIO_AF4, i2c_scl_pin | i2c_sda_pin);
+
+    i2c_reset(I2C1);
+    i2c_peripheral_disable(I2C1);
+    i2c_enable_analog_filter(I2C1);
+    i2c_set_digital_filter(I2C1, 0);
+    i2c_set_speed(I2C1, i2c_speed, 8);
+    i2c_set_7bit_addr_mode(I2C1);
+    i2c_peripheral_enable(I2C1);
+
+    init_dma_channel(tx_dma_channel, &I2C_TXDR(I2C1));
+    dma_set_read_from_memory(DMA1, tx_dma_channel);
+    init_dma_channel(rx_dma_channel, &I2C_RXDR(I2C1));
+    dma_set_read_from_peripheral(DMA1, rx_dma_channel);
+
+    // I2C interrupt is only used to wake the MCU
+    nvic_enable_irq(NVIC_I2C1_IRQ);
+
+    update_clock();
+}
+
+void i2c_hw::update_clock() {
+    // rcc_ahb_frequency is only known at run-time
+    recovery_delay_loops = i2c_bit_bang_timing::delay_loops(rcc_ahb_frequency, recovery_bus_freq);
+}
+
+bool i2c_hw::write_data(uint8_t addr, uint8_t reg, int data_len, const uint8_t* data, bool end_with_stop) {
+    if (!write_reg_addr(addr, reg, data_len, end_with_stop)) {
+        abort_transfer();
+        return false;
+    }
+
+    bool use_dma = data_len >= min_dma_len;
+    if (use_dma) {
+        dma_set_memory_address(DMA1, tx_dma_channel, (uint32_t)data);
+        dma_set_number_of_data(DMA1, tx_dma_channel, data_len);
+        dma_enable_channel(DMA1, tx_dma_channel);
+        i2c_enable_txdma(I2C1);
+
+    } else {
+        for (int i = 0; i < data_len; i++) {
+            if (!wait_for(I2C_ISR_TXIS, false)) {
+                abort_transfer();
+                return false;
+            }
+            i2c_send_data(I2C1, data[i]);
+        }
+    }
+
+    bool ack = wait_for(end_with_stop ? I2C_ISR_STOPF : I2C_ISR_TC, use_dma);
+    if (!ack) {
+        abort_transfer();
+        return false;
+    }
+
+    if (use_dma) {
+        i2c_disable_txdma(I2C1);
+        dma_disable_channel(DMA1, tx_dma_channel);
+    }
+    I2C_ICR(I2C1) = I2C_ICR_STOPCF;
+    return true;
+}
+
+bool i2c_hw::read_data(uint8_t addr, uint8_t reg, int data_len, uint8_t* data) {
+    if (!write_reg_addr(addr, reg, 0, false) || !wait_for(I2C_ISR_TC, false)) {
+        abort_transfer();
+        return false;
+    }
+
+    // repeated start for reading
+    i2c_set_read_transfer_dir(I2C1);
+    i2c_set_bytes_to_transfer(I2C1, data_len);
+    i2c_enable_autoend(I2C1);
+
+    bool use_dma = data_len >= min_dma_len;
+    if (use_dma) {
+        dma_set_memory_address(DMA1, rx_dma_channel, (uint32_t)data);
+        dma_set_number_of_data(DMA1, rx_dma_channel, data_len);
+        dma_enable_channel(DMA1, rx_dma_channel);
+        i2c_enable_rxdma(I2C1);
+    }
+
+    i2c_send_start(I2C1);
+
+    if (!use_dma) {
+        for (int i = 0; i < data_len; i++) {
+            if (!wait_for(I2C_ISR_RXNE, false)) {
+                abort_transfer();
+                return false;
+            }
+            data[i] = i2c_get_data(I2C1);
+        }
+    }
+
+    bool ack = wait_for(I2C_ISR_STOPF, use_dma);
+    if (!ack) {
+        abort_transfer();
+        return false;
+    }
+
+    if (use_dma) {
+        i2c_disable_rxdma(I2C1);
+        dma_disable_channel(DMA1, rx_dma_channel);
+    }
+    I2C_ICR(I2C1) = I2C_ICR_STOPCF;
+    return true;
+}
+
+// Half an SCL period in standard mode (same delay loop as `i2c_bit_bang`)
+void i2c_hw::recovery_delay() {
+    uint32_t n = recovery_delay_loops;
+    asm volatile("1: subs %0, #1\n\tbne 1b" : "+l"(n) : : "cc");
+}
+
+void i2c_hw::recover_bus() {
+    // Temporarily take over the pins as open-drain GPIOs
+    i2c_peripheral_disable(I2C1);
+    gpio_set(i2c_port, i2c_scl_pin | i2c_sda_pin);
+    gpio_mode_setup(i2c_port, GPIO_MODE_OUTPUT, GPIO_PUPD_PULLUP, i2c_scl_pin | i2c_sda_pin);
+
+    // clock out remaining bits (at most 9 clock cycles)
+    for (int i = 0; i < 9 && gpio_get(i2c_port, i2c_sda_pin) == 0; i++) {
+        gpio_clear(i2c_port, i2c_scl_pin);
+        recovery_delay();
+        gpio_set(i2c_port, i2c_scl_pin);
+        recovery_delay();
+    }
+
+    // STOP condition
+    gpio_clear(i2c_port, i2c_scl_pin);
+    recovery_delay();
+    gpio_clear(i2c_port, i2c_sda_pin);
+    recovery_delay();
+    gpio_set(i2c_port, i2c_scl_pin);
+    recovery_delay();
+    gpio_set(i2c_port, i2c_sda_pin);
+    recovery_delay();
+
+    gpio_mode_setup(i2c_port, GPIO_MODE_AF, GPIO_PUPD_PULLUP, i2c_scl_pin | i2c_sda_pin);
+    i2c_peripheral_enable(I2C1);
+}
+
+bool i2c_hw::write_reg_addr(uint8_t addr, uint8_t reg, int data_len, bool autoend) {
+    i2c_set_7bit_address(I2C1, addr);
+    i2c_set_write_transfer_dir(I2C1);
+    i2c_set_bytes_to_transfer(I2C1, data_len + 1);
+    if (autoend)
+        i2c_enable_autoend(I2C1);
+    else
+        i2c_disable_autoend(I2C1);
+
+    i2c_send_start(I2C1);
+
+    if (!wait_for(I2C_ISR_TXIS, false))
+        return false;
+
+    i2c_send_data(I2C1, reg);
+    return true;
+}
+
+bool i2c_hw::wait_for(uint32_t flags, bool sleep) {
+    int limit = sleep ? max_sleeps : max_polls;
+    for (int i = 0; i < limit; i++) {
+        if (sleep) {
+            // Interrupts are disabled so the I2C interrupt cannot fire between
+            // checking the flags and going to sleep. It will still wake the MCU.
+            // The previous state is restored as this might run in an interrupt handler.
+            uint32_t primask = cm_mask_interrupts(1);
+            if ((I2C_ISR(I2C1) & (flags | error_flags)) == 0) {
+                I2C_CR1(I2C1) |= interrupt_enables;
+                __WFI();
+            }
+            cm_mask_interrupts(primask);
+        }
+
+        uint32_t isr = I2C_ISR(I2C1);
+        if ((isr & error_flags) != 0)
+            return false;
+        if ((isr & flags) != 0)
+            return true;
+    }
+
+    return false;
+}
+
+void i2c_hw::abort_transfer() {
+    i2c_disable_txdma(I2C1);
+    i2c_disable_rxdma(I2C1);
+    dma_disable_channel(DMA1, tx_dma_channel);
+    dma_disable_channel(DMA1, rx_dma_channel);
+
+    // On NACK, the peripheral generates the STOP condition itself
+    if ((I2C_ISR(I2C1) & I2C_ISR_NACKF) != 0)
+        wait_for(I2C_ISR_STOPF, false);
+
+    I2C_ICR(I2C1) = I2C_ICR_NACKCF | I2C_ICR_STOPCF | I2C_ICR_BERRCF | I2C_ICR_ARLOCF;
+
+    // Reset peripheral state (in case of bus error or timeout)
+    i2c_peripheral_disable(I2C1);
+    i2c_peripheral_enable(I2C1);
+}
+
+} // namespace usb_pd
+
+extern "C" void i2c1_isr(void) {
+    // Disable I2C interrupts; the waiting code checks the status flags
+    I2C_CR1(I2C1) &= ~usb_pd::interrupt_enables;
+}
+
+#endif
@@ -0,0 +1,102 @@
+//
+// USB Power Delivery Sink Using FUSB302B
+// Copyright (c) 2020 Manuel Bleichenbacher
+//
+// Licensed under MIT License
+// https://opensource.org/licenses/MIT
+//
+// Profiling of I2C communication with the FUSB302B
+//
+
+#include "i2c_profiler.h"
+
+#if defined(PD_I2C_PROFILE)
+
+#include "pd_debug.h"
+
+namespace usb_pd {
+
+// Line length of dump incl. line break
+constexpr int max_line_len = 40;
+
+void i2c_profiler::reset() {
+    for (int i = 0; i < num_regs; i++)
+        regs[i] = {};
+    dump_line = -1;
+}
+
+void i2c_profiler::record(reg r, int data_len, uint32_t bus_time_us) {
+    int idx = index(r);
+    if (idx < 0)
+        return;
+
+    i2c_reg_profile& profile = regs[idx];
+    profile.transactions++;
+    profile.bytes += data_len;
+    profile.bus_time_us += bus_time_us;
+}
+
+const i2c_reg_profile& i2c_profiler::profile(reg r) {
+    static const i2c_reg_profile undefined_reg = {};
+    int idx = index(r);
+    return idx >= 0 ? regs[idx] : undefined_reg;
+}
+
+uint32_t i2c_profiler::total_transactions() {
+    uint32_t total = 0;
+    for (int i = 0; i < num_regs; i++)
+        total += regs[i].transactions;
+    return total;
+}
+
+uint32_t i2c_profiler::total_bus_time_us() {
+    uint32_t total = 0;
+    for (int i = 0; i < num_regs; i++)
+        total += regs[i].bus_time_us;
+    return total;
+}
+
+void i2c_profiler::dump() {
+#if defined(PD_DEBUG)
+    dump_transactions = total_transactions();
+    dump_bus_time_us = total_bus_time_us();
+    dump_line = 0;
+    stream();
+#else
+    // no output: just restart
+    reset();
+#endif
+}
+
+void i2c_profiler::stream() {
+#if defined(PD_DEBUG)
+    // Compact format as the debug output buffer is small
+    while (dump_line >= 0 && debug_tx_space() >= max_line_len) {
+        if (dump_line == 0) {
+            DEBUG_LOG("I2C reg tx/bytes/us\r\n", 0);
+
+        } else if (dump_line <= num_regs) {
+            i2c_reg_profile& profile = regs[dump_line - 1];
+            if (profile.transactions != 0) {
+                DEBUG_LOG("%02lx ", static_cast<uint32_t>(reg_at(dump_line - 1)));
+                DEBUG_LOG("%lu/", profile.transactions);
+                DEBUG_LOG("%lu/", profile.bytes);
+                DEBUG_LOG("%lu\r\n", profile.bus_time_us);
+                profile = {};
+            }
+
+        } else {
+            DEBUG_LOG("total %lu/", dump_transactions);
+            DEBUG_LOG("%lu us\r\n", dump_bus_time_us);
+            dump_line = -1;
+            break;
+        }
+
+        dump_line++;
+    }
+#endif
+}
+
+} // namespace usb_pd
+
+#endif
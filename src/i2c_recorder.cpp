@@ -0,0 +1,116 @@
+//
+// USB Power Delivery Sink Using FUSB302B
+// Copyright (c) 2020 Manuel Bleichenbacher
+//
+// Licensed under MIT License
+// https://opensource.org/licenses/MIT
+//
+// Recording of I2C communication with the FUSB302B
+//
+
+#include "i2c_recorder.h"
+
+#if defined(PD_I2C_RECORD)
+
+#include "dispatcher.h"
+#include "hal.h"
+#include "pd_debug.h"
+
+namespace usb_pd {
+
+// Hex data is printed in chunks as the debug output formats at most 80 characters at once
+constexpr int hex_chunk_len = 32;
+
+static const char* HEX_DIGITS = "0123456789abcdef";
+
+void i2c_recorder::reset() {
+    head = tail = 0;
+    num_lost = 0;
+    total_lost = 0;
+}
+
+void i2c_recorder::record(int port, bool is_write, uint8_t reg, bool success, int data_len, const uint8_t* data,
+                          uint32_t time) {
+    if (!success && !is_write)
+        data_len = 0; // data is invalid
+    if (data_len > max_data_len)
+        data_len = max_data_len;
+
+    int used = head - tail;
+    if (used < 0)
+        used += buf_len;
+    if (buf_len - 1 - used < header_len + data_len) {
+        num_lost++;
+        total_lost++;
+        return;
+    }
+
+    put((is_write ? flag_write : 0) | (success ? 0 : flag_failed) | data_len);
+    put(port);
+    put(reg);
+    for (int i = 0; i < 4; i++)
+        put(time >> (i * 8));
+    for (int i = 0; i < data_len; i++)
+        put(data[i]);
+
+    dispatcher.signal(subsystem::debug_output);
+}
+
+void i2c_recorder::stream() {
+    // Line length incl. timestamp, register, hex data and line break
+    constexpr int max_line_len = 20 + 2 * max_data_len;
+
+    while (head != tail && debug_tx_space() >= max_line_len) {
+        uint8_t flags = get();
+        uint8_t port = get();
+        uint8_t reg = get();
+        uint32_t time = 0;
+        for (int i = 0; i < 4; i++)
+            time |= static_cast<uint32_t>(get()) << (i * 8);
+
+        DEBUG_LOG("@%lu ", time);
+        DEBUG_LOG("%lu:", port);
+        DEBUG_LOG((flags & flag_write) != 0 ? "W%02lx" : "R%02lx", reg);
+        DEBUG_LOG((flags & flag_failed) != 0 ? "! " : " ", 0);
+
+        char hex[2 * hex_chunk_len + 1];
+        int data_len = flags & max_data_len;
+        while (data_len > 0) {
+            int n = data_len < hex_chunk_len ? data_len : hex_chunk_len;
+            for (int i = 0; i < n; i++) {
+                uint8_t b = get();
+                hex[2 * i] = HEX_DIGITS[b >> 4];
+                hex[2 * i + 1] = HEX_DIGITS[b & 0x0f];
+            }
+            hex[2 * n] = 0;
+            DEBUG_LOG(hex, 0);
+            data_len -= n;
+        }
+        DEBUG_LOG("\r\n", 0);
+    }
+
+    if (num_lost != 0 && debug_tx_space() >= max_line_len) {
+        DEBUG_LOG("@%lu lost ", static_cast<uint32_t>(hal.micros()));
+        DEBUG_LOG("%lu\r\n", num_lost);
+        num_lost = 0;
+    }
+}
+
+void i2c_recorder::put(uint8_t b) {
+    buf[head] = b;
+    head++;
+    if (head >= buf_len)
+        head = 0;
+}
+
+uint8_t i2c_recorder::get() {
+    uint8_t b = buf[tail];
+    tail++;
+    if (tail >= buf_len)
+        tail = 0;
+    return b;
+}
+
+} // namespace usb_pd
+
+#endif
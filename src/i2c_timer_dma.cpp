@@ -0,0 +1,268 @@
+//
+// USB Power Delivery Sink Using FUSB302B
+// Copyright (c) 2020 Manuel Bleichenbacher
+//
+// Licensed under MIT License
+// https://opensource.org/licenses/MIT
+//
+// I2C bit banging using a timer and DMA
+//
+
+#include "i2c_timer_dma.h"
+
+#if defined(PD_I2C_TIMER_DMA)
+
+#include <libopencm3/cm3/cortex.h>
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/stm32/dma.h>
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/timer.h>
+#include <libopencmsis/core_cm3.h>
+
+#include "hal.h"
+
+namespace usb_pd {
+
+// DMA channel writing the waveform (TIM1 update)
+constexpr uint8_t wave_dma_channel = DMA_CHANNEL5;
+// DMA channel sampling SDA (TIM1 compare channel 4)
+constexpr uint8_t sample_dma_channel = DMA_CHANNEL4;
+
+// Data of this length or longer is transferred using timer and DMA
+constexpr int min_dma_len = 4;
+
+// Minimum timer period (in timer clock cycles); two DMA transfers are needed per period
+constexpr uint32_t min_slot_cycles = 24;
+
+// Timer periods per bit: SCL low, set SDA, SCL high
+constexpr int slots_per_bit = 3;
+constexpr int slots_per_byte = 9 * slots_per_bit;
+
+constexpr uint32_t scl_low = static_cast<uint32_t>(scl_pin) << 16;
+constexpr uint32_t scl_high = scl_pin;
+constexpr uint32_t sda_low = static_cast<uint32_t>(sda_pin) << 16;
+constexpr uint32_t sda_high = sda_pin;
+
+// Waveform (BSRR values) for two bytes
+static uint32_t wave[2 * slots_per_byte];
+
+// SDA samples (IDR values) for two bytes
+static uint16_t samples[2 * slots_per_byte];
+
+// State of the running transfer (shared with DMA interrupt handler)
+static struct {
+    const uint8_t* tx_data;
+    uint8_t* rx_data;
+    int len;
+    // index of next byte to fill into waveform buffer
+    int fill_index;
+    // index of next byte to be sampled
+    int sampled_index;
+    volatile bool is_busy;
+    volatile bool is_nack;
+} xfer;
+
+static void stop_waveform() {
+    timer_disable_counter(TIM1);
+    timer_disable_irq(TIM1, TIM_DIER_UDE | TIM_DIER_CC4DE);
+    dma_disable_channel(DMA1, wave_dma_channel);
+    dma_disable_channel(DMA1, sample_dma_channel);
+    xfer.is_busy = false;
+}
+
+// Fills one half of the waveform buffer with the next byte
+static void fill_wave(int half) {
+    uint32_t* w = wave + half * slots_per_byte;
+    int index = xfer.fill_index++;
+
+    if (index >= xfer.len) {
+        // idle: keep SCL low
+        for (int i = 0; i < slots_per_byte; i++)
+            w[i] = scl_low;
+        return;
+    }
+
+    // When reading, SDA is released for the data bits and the ninth bit
+    // acknowledges all bytes except the last one.
+    bool is_read = xfer.rx_data != nullptr;
+    uint8_t value = is_read ? 0xff : xfer.tx_data[index];
+    bool ninth_bit = !is_read || index == xfer.len - 1;
+
+    for (int i = 0; i < 9; i++) {
+        bool bit = i < 8 ? (value & (0x80 >> i)) != 0 : ninth_bit;
+        w[0] = scl_low;
+        w[1] = bit ? sda_high : sda_low;
+        w[2] = scl_high;
+        w += slots_per_bit;
+    }
+}
+
+// Decodes the sampled byte and refills the waveform buffer half
+static void on_byte_sampled(int half) {
+    if (!xfer.is_busy)
+        return;
+
+    // sample taken while SCL is high
+    const uint16_t* s = samples + half * slots_per_byte + 2;
+    uint8_t value = 0;
+    for (int i = 0; i < 8; i++)
+        value = (value << 1) | ((s[i * slots_per_bit] & sda_pin) != 0);
+    bool ack = (s[8 * slots_per_bit] & sda_pin) == 0;
+
+    int index = xfer.sampled_index++;
+    if (xfer.rx_data != nullptr)
+        xfer.rx_data[index] = value;
+    else if (!ack)
+        xfer.is_nack = true;
+
+    if (xfer.is_nack || xfer.sampled_index == xfer.len) {
+        stop_waveform();
+        return;
+    }
+
+    fill_wave(half);
+}
+
+static void init_dma_channel(uint8_t channel, uint32_t size) {
+    dma_channel_reset(DMA1, channel);
+    dma_set_priority(DMA1, channel, DMA_CCR_PL_VERY_HIGH);
+    dma_set_memory_size(DMA1, channel, size == 32 ? DMA_CCR_MSIZE_32BIT : DMA_CCR_MSIZE_16BIT);
+    dma_set_peripheral_size(DMA1, channel, size == 32 ? DMA_CCR_PSIZE_32BIT : DMA_CCR_PSIZE_16BIT);
+    dma_enable_memory_increment_mode(DMA1, channel);
+    dma_enable_circular_mode(DMA1, channel);
+}
+
+void i2c_timer_dma::init() {
+    bit_bang.init();
+
+    rcc_periph_clock_enable(RCC_DMA1);
+    rcc_periph_clock_enable(RCC_TIM1);
+    rcc_periph_reset_pulse(RST_TIM1);
+
+    init_dma_channel(wave_dma_channel, 32);
+    dma_set_read_from_memory(DMA1, wave_dma_channel);
+    dma_set_peripheral_address(DMA1, wave_dma_channel, (uint32_t)&GPIO_BSRR(scl_port));
+    dma_set_memory_address(DMA1, wave_dma_channel, (uint32_t)wave);
+
+    init_dma_channel(sample_dma_channel, 16);
+    dma_set_read_from_peripheral(DMA1, sample_dma_channel);
+    dma_set_peripheral_address(DMA1, sample_dma_channel, (uint32_t)&GPIO_IDR(sda_port));
+    dma_set_memory_address(DMA1, sample_dma_channel, (uint32_t)samples);
+    dma_enable_half_transfer_interrupt(DMA1, sample_dma_channel);
+    dma_enable_transfer_complete_interrupt(DMA1, sample_dma_channel);
+
+    nvic_set_priority(NVIC_DMA1_CHANNEL4_7_DMA2_CHANNEL3_5_IRQ, 0);
+    nvic_enable_irq(NVIC_DMA1_CHANNEL4_7_DMA2_CHANNEL3_5_IRQ);
+
+    update_clock();
+}
+
+void i2c_timer_dma::update_clock() {
+    bit_bang.update_clock();
+
+    // timer period: a third of a bit
+    uint32_t slot_cycles = rcc_apb1_frequency / (slots_per_bit * PD_I2C_SPEED_KHZ * 1000);
+    if (slot_cycles < min_slot_cycles)
+        slot_cycles = min_slot_cycles;
+    sample_pos = slot_cycles * 3 / 4;
+
+    timer_set_prescaler(TIM1, 0);
+    timer_set_period(TIM1, slot_cycles - 1);
+    timer_set_oc_value(TIM1, TIM_OC4, sample_pos);
+
+    uint32_t cycles_per_us = rcc_apb1_frequency / 1000000;
+    byte_time_us = (slots_per_byte * slot_cycles + cycles_per_us - 1) / cycles_per_us;
+}
+
+bool i2c_timer_dma::write_data(uint8_t addr, uint8_t reg, int data_len, const uint8_t* data, bool end_with_stop) {
+    if (data_len < min_dma_len)
+        return bit_bang.write_data(addr, reg, data_len, data, end_with_stop);
+
+    bit_bang.write_start_cond();
+    bool ack = bit_bang.write_byte(addr << 1);
+    ack = ack && bit_bang.write_byte(reg);
+    ack = ack && transfer(data, nullptr, data_len);
+    if (end_with_stop || !ack)
+        bit_bang.write_stop_cond();
+    return ack;
+}
+
+bool i2c_timer_dma::read_data(uint8_t addr, uint8_t reg, int data_len, uint8_t* data) {
+    if (data_len < min_dma_len)
+        return bit_bang.read_data(addr, reg, data_len, data);
+
+    // STOP condition has already been written if it fails
+    if (!bit_bang.write_data(addr, reg, 0, nullptr, false))
+        return false;
+
+    bit_bang.write_start_cond();
+    bool ack = bit_bang.write_byte((addr << 1) | 1);
+    ack = ack && transfer(nullptr, data, data_len);
+    bit_bang.write_stop_cond();
+    return ack;
+}
+
+bool i2c_timer_dma::transfer(const uint8_t* tx_data, uint8_t* rx_data, int data_len) {
+    xfer.tx_data = tx_data;
+    xfer.rx_data = rx_data;
+    xfer.len = data_len;
+    xfer.fill_index = 0;
+    xfer.sampled_index = 0;
+    xfer.is_nack = false;
+    xfer.is_busy = true;
+
+    fill_wave(0);
+    fill_wave(1);
+
+    dma_clear_interrupt_flags(DMA1, wave_dma_channel, DMA_GIF | DMA_TCIF | DMA_HTIF | DMA_TEIF);
+    dma_clear_interrupt_flags(DMA1, sample_dma_channel, DMA_GIF | DMA_TCIF | DMA_HTIF | DMA_TEIF);
+    dma_set_number_of_data(DMA1, wave_dma_channel, 2 * slots_per_byte);
+    dma_set_number_of_data(DMA1, sample_dma_channel, 2 * slots_per_byte);
+    dma_enable_channel(DMA1, wave_dma_channel);
+    dma_enable_channel(DMA1, sample_dma_channel);
+
+    // Start just after the compare event so the first event is the
+    // update event writing the first waveform word.
+    TIM_SR(TIM1) = 0;
+    timer_set_counter(TIM1, sample_pos + 1);
+    timer_enable_irq(TIM1, TIM_DIER_UDE | TIM_DIER_CC4DE);
+    timer_enable_counter(TIM1);
+
+    // Sleep until done; the DMA interrupt wakes the MCU once per byte (other
+    // interrupts such as SysTick as well). A transfer taking two bytes
+    // longer than expected has stalled.
+    uint64_t start_us = hal.micros();
+    uint32_t timeout_us = (data_len + 2) * byte_time_us;
+    // The previous interrupt state is restored as this might run in an interrupt handler.
+    while (xfer.is_busy && hal.micros() - start_us <= timeout_us) {
+        uint32_t primask = cm_mask_interrupts(1);
+        if (xfer.is_busy)
+            __WFI();
+        cm_mask_interrupts(primask);
+    }
+
+    bool ack = !xfer.is_busy && !xfer.is_nack;
+    stop_waveform();
+
+    // The transfer might have stopped with SCL high
+    bit_bang.clear_scl();
+
+    return ack;
+}
+
+} // namespace usb_pd
+
+extern "C" void dma1_channel4_7_dma2_channel3_5_isr(void) {
+    using namespace usb_pd;
+
+    if (dma_get_interrupt_flag(DMA1, sample_dma_channel, DMA_HTIF)) {
+        dma_clear_interrupt_flags(DMA1, sample_dma_channel, DMA_HTIF);
+        on_byte_sampled(0);
+    }
+    if (dma_get_interrupt_flag(DMA1, sample_dma_channel, DMA_TCIF)) {
+        dma_clear_interrupt_flags(DMA1, sample_dma_channel, DMA_TCIF);
+        on_byte_sampled(1);
+    }
+}
+
+#endif
@@ -0,0 +1,168 @@
+//
+// USB Power Delivery Sink Using FUSB302B
+// Copyright (c) 2020 Manuel Bleichenbacher
+//
+// Licensed under MIT License
+// https://opensource.org/licenses/MIT
+//
+// Timer driven RGB LED
+//
+
+#include "led_engine.h"
+
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/stm32/gpio.h>
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/timer.h>
+
+namespace usb_pd {
+
+// LEDs are active low
+constexpr auto led_red_port = GPIOA;
+constexpr uint16_t led_red_pin = GPIO5;
+constexpr auto led_green_port = GPIOA;
+constexpr uint16_t led_green_pin = GPIO6; // TIM3_CH1
+constexpr auto led_blue_port = GPIOA;
+constexpr uint16_t led_blue_pin = GPIO7; // TIM3_CH2
+
+// PWM: 255 ticks per period at 250kHz (about 1kHz)
+constexpr uint32_t pwm_tick_hz = 250000;
+constexpr uint32_t pwm_period = 255;
+
+// Flash patterns: 1 tick per ms
+constexpr uint32_t flash_tick_hz = 1000;
+constexpr uint32_t max_flash_period = 65535;
+
+static void set_pin(uint32_t port, uint16_t pin, bool on) {
+    if (on)
+        gpio_clear(port, pin);
+    else
+        gpio_set(port, pin);
+}
+
+static bool is_full_or_zero(uint8_t intensity) {
+    return intensity == 0 || intensity == 255;
+}
+
+void led_engine::init() {
+    set_pin(led_red_port, led_red_pin, false);
+    set_pin(led_green_port, led_green_pin, false);
+    set_pin(led_blue_port, led_blue_pin, false);
+    gpio_mode_setup(led_red_port, GPIO_MODE_OUTPUT, GPIO_PUPD_NONE, led_red_pin);
+    gpio_mode_setup(led_green_port, GPIO_MODE_OUTPUT, GPIO_PUPD_NONE, led_green_pin);
+    gpio_mode_setup(led_blue_port, GPIO_MODE_OUTPUT, GPIO_PUPD_NONE, led_blue_pin);
+    gpio_set_af(led_green_port, GPIO_AF1, led_green_pin);
+    gpio_set_af(led_blue_port, GPIO_AF1, led_blue_pin);
+
+    rcc_periph_clock_enable(RCC_TIM3);
+    rcc_periph_reset_pulse(RST_TIM3);
+
+    // Channel 1 (green) and 2 (blue): PWM output, active low
+    timer_set_oc_mode(TIM3, TIM_OC1, TIM_OCM_PWM1);
+    timer_set_oc_mode(TIM3, TIM_OC2, TIM_OCM_PWM1);
+    timer_enable_oc_preload(TIM3, TIM_OC1);
+    timer_enable_oc_preload(TIM3, TIM_OC2);
+    timer_set_oc_polarity_low(TIM3, TIM_OC1);
+    timer_set_oc_polarity_low(TIM3, TIM_OC2);
+    timer_enable_oc_output(TIM3, TIM_OC1);
+    timer_enable_oc_output(TIM3, TIM_OC2);
+
+    // Channel 3 (red): compare interrupt only
+    timer_set_oc_mode(TIM3, TIM_OC3, TIM_OCM_FROZEN);
+    timer_enable_oc_preload(TIM3, TIM_OC3);
+
+    // Only counter overflows trigger the update interrupt (not TIM_EGR_UG)
+    timer_enable_preload(TIM3);
+    timer_update_on_overflow(TIM3);
+    nvic_enable_irq(NVIC_TIM3_IRQ);
+
+    is_running_ = false;
+}
+
+void led_engine::show(rgb_color c) {
+    // Red has no timer channel: no PWM, round to full on or off
+    c.red = c.red >= 128 ? 255 : 0;
+
+    if (is_full_or_zero(c.red) && is_full_or_zero(c.green) && is_full_or_zero(c.blue)) {
+        stop_timer();
+        set_pin(led_red_port, led_red_pin, c.red != 0);
+        set_pin(led_green_port, led_green_pin, c.green != 0);
+        set_pin(led_blue_port, led_blue_pin, c.blue != 0);
+        return;
+    }
+
+    start_timer(pwm_tick_hz, pwm_period, c.red, c.green, c.blue);
+}
+
+bool led_engine::flash(rgb_color c, uint32_t on, uint32_t off) {
+    if (!is_full_or_zero(c.red) || !is_full_or_zero(c.green) || !is_full_or_zero(c.blue))
+        return false;
+    if (on == 0 || off == 0 || on + off > max_flash_period)
+        return false;
+
+    start_timer(flash_tick_hz, on + off, c.red != 0 ? on : 0, c.green != 0 ? on : 0, c.blue != 0 ? on : 0);
+    return true;
+}
+
+void led_engine::start_timer(uint32_t tick_hz, uint32_t period, uint32_t red, uint32_t green, uint32_t blue) {
+    stop_timer();
+
+    this->tick_hz = tick_hz;
+    timer_set_prescaler(TIM3, rcc_apb1_frequency / tick_hz - 1);
+    timer_set_period(TIM3, period - 1);
+    timer_set_oc_value(TIM3, TIM_OC1, green);
+    timer_set_oc_value(TIM3, TIM_OC2, blue);
+    timer_set_oc_value(TIM3, TIM_OC3, red);
+    timer_set_counter(TIM3, 0);
+    timer_generate_event(TIM3, TIM_EGR_UG); // load prescaler, period and compare values
+    timer_clear_flag(TIM3, TIM_SR_UIF | TIM_SR_CC3IF);
+
+    // The counter starts at the beginning of the on phase
+    set_pin(led_red_port, led_red_pin, red != 0);
+    if (red != 0 && red < period)
+        timer_enable_irq(TIM3, TIM_DIER_UIE | TIM_DIER_CC3IE);
+
+    gpio_mode_setup(led_green_port, GPIO_MODE_AF, GPIO_PUPD_NONE, led_green_pin);
+    gpio_mode_setup(led_blue_port, GPIO_MODE_AF, GPIO_PUPD_NONE, led_blue_pin);
+
+    timer_enable_counter(TIM3);
+    is_running_ = true;
+}
+
+void led_engine::stop_timer() {
+    if (!is_running_)
+        return;
+
+    timer_disable_counter(TIM3);
+    timer_disable_irq(TIM3, TIM_DIER_UIE | TIM_DIER_CC3IE);
+    nvic_clear_pending_irq(NVIC_TIM3_IRQ);
+    gpio_mode_setup(led_green_port, GPIO_MODE_OUTPUT, GPIO_PUPD_NONE, led_green_pin);
+    gpio_mode_setup(led_blue_port, GPIO_MODE_OUTPUT, GPIO_PUPD_NONE, led_blue_pin);
+    is_running_ = false;
+}
+
+void led_engine::update_clock() {
+    if (!is_running_)
+        return;
+
+    // Keep the position within the period; the update event only loads the new prescaler
+    uint32_t count = timer_get_counter(TIM3);
+    timer_set_prescaler(TIM3, rcc_apb1_frequency / tick_hz - 1);
+    timer_generate_event(TIM3, TIM_EGR_UG);
+    timer_set_counter(TIM3, count);
+}
+
+} // namespace usb_pd
+
+// Switches the red LED (not connected to a timer channel)
+extern "C" void tim3_isr() {
+    if (timer_get_flag(TIM3, TIM_SR_UIF)) {
+        timer_clear_flag(TIM3, TIM_SR_UIF);
+        gpio_clear(usb_pd::led_red_port, usb_pd::led_red_pin);
+    }
+
+    if (timer_get_flag(TIM3, TIM_SR_CC3IF)) {
+        timer_clear_flag(TIM3, TIM_SR_CC3IF);
+        gpio_set(usb_pd::led_red_port, usb_pd::led_red_pin);
+    }
+}
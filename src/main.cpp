@@ -6,9 +6,19 @@
 // https://opensource.org/licenses/MIT
 //
 
+#include "dispatcher.h"
 #include "eeprom.h"
 #include "pd_debug.h"
 #include "pd_sink.h"
+#include "timer_service.h"
+
+#if defined(PD_I2C_PROFILE)
+#include "i2c_profiler.h"
+#endif
+
+#if defined(PD_I2C_RECORD)
+#include "i2c_recorder.h"
+#endif
 
 #include <algorithm>
 
@@ -18,6 +28,10 @@ constexpr uint16_t nvs_voltage_key = 0;
 
 mcu_hal usb_pd::hal;
 
+timer_service usb_pd::timers;
+
+event_dispatcher usb_pd::dispatcher;
+
 static pd_sink power_sink;
 
 static eeprom nvs;
@@ -32,11 +46,24 @@ static uint16_t desired_mode = 0;
 
 static bool in_config_mode = false;
 
+static bool is_startup_over = false;
+
 static void sink_callback(callback_event event);
+static void on_startup_timer(void* context);
+
+static sw_timer startup_timer(on_startup_timer);
 static void update_led();
 static void switch_voltage();
 static void on_source_caps_changed();
 static void loop();
+static void init_dispatcher();
+static void on_pd_ctrl_work(void* context);
+static void on_timer_work(void* context);
+static void on_button_work(void* context);
+static void on_button_poll_work(void* context);
+#if defined(PD_I2C_RECORD) || defined(PD_I2C_PROFILE)
+static void on_debug_output_work(void* context);
+#endif
 static void run_config_mode();
 static void set_led_prog_mode(int mode);
 static void save_mode(int mode);
@@ -57,17 +84,23 @@ int main() {
     power_sink.set_event_callback(sink_callback);
     power_sink.init();
 
-    // Wait 60ms for button presses
-    uint32_t start = hal.millis();
-    while (hal.millis() - start < 60) {
-        hal.poll();
+    // Wait 60ms for button presses (PD events are handled afterwards)
+    dispatcher.set_handler(subsystem::timer, on_timer_work);
+    dispatcher.set_handler(subsystem::button, on_button_poll_work);
+    dispatcher.signal(subsystem::button);
+    timers.start(startup_timer, 60);
+    while (!is_startup_over) {
+        dispatcher.run();
 
         // Enter configuration mode if button is being pressed on power up
         if (hal.is_button_being_pressed())
             run_config_mode();
+        else if (!is_startup_over)
+            hal.wait_for_event();
     }
 
     update_led();
+    init_dispatcher();
 
     // Work in regular loop
     while (true) {
@@ -78,16 +111,62 @@ int main() {
     }
 }
 
-// Regular operations loop
+void on_startup_timer(void*) {
+    is_startup_over = true;
+}
+
+// Regular operations loop: only subsystems with pending work are run
 void loop() {
-    hal.poll();
+    dispatcher.run();
+}
+
+void init_dispatcher() {
+    dispatcher.set_handler(subsystem::pd_ctrl, on_pd_ctrl_work);
+    dispatcher.set_handler(subsystem::timer, on_timer_work);
+    dispatcher.set_handler(subsystem::button, on_button_work);
+#if defined(PD_I2C_RECORD) || defined(PD_I2C_PROFILE)
+    dispatcher.set_handler(subsystem::debug_output, on_debug_output_work);
+#endif
+
+    // Events might have occurred before the handlers were set
+    dispatcher.signal(subsystem::pd_ctrl);
+    dispatcher.signal(subsystem::timer);
+    dispatcher.signal(subsystem::button);
+    dispatcher.signal(subsystem::debug_output);
+}
+
+void on_pd_ctrl_work(void*) {
     power_sink.poll();
+}
+
+void on_timer_work(void*) {
+    timers.poll();
+}
+
+void on_button_work(void*) {
+    hal.poll_button();
 
     // In mode 0, the button switches the voltage
     if (desired_mode == 0 && hal.has_button_been_pressed())
         switch_voltage();
 }
 
+// Button handler if presses are evaluated by the caller (startup and configuration mode)
+void on_button_poll_work(void*) {
+    hal.poll_button();
+}
+
+#if defined(PD_I2C_RECORD) || defined(PD_I2C_PROFILE)
+void on_debug_output_work(void*) {
+#if defined(PD_I2C_RECORD)
+    hal.pd_ctrl_recorder().stream();
+#endif
+#if defined(PD_I2C_PROFILE)
+    hal.pd_ctrl_profiler().stream();
+#endif
+}
+#endif
+
 // Change the voltage to the next source capability
 void switch_voltage() {
     // Only works with USB PD
@@ -129,6 +208,10 @@ void sink_callback(callback_event event) {
 
     case callback_event::power_ready:
         DEBUG_LOG("Voltage: %d\r\n", power_sink.active_voltage);
+#if defined(PD_I2C_PROFILE)
+        // Print and restart the I2C profile of each negotiation (continued by `on_debug_output_work()`)
+        hal.pd_ctrl_profiler().dump();
+#endif
         break;
 
     case callback_event::protocol_changed:
@@ -218,10 +301,16 @@ void run_config_mode() {
     in_config_mode = true;
     hal.set_led(color::cyan, 70, 70);
 
+    // PD events are handled as usual; button presses select the mode
+    init_dispatcher();
+    dispatcher.set_handler(subsystem::button, on_button_poll_work);
+
     // wait until button has been released
-    while (hal.is_button_being_pressed()) {
-        hal.poll();
-        power_sink.poll();
+    while (true) {
+        dispatcher.run();
+        if (!hal.is_button_being_pressed())
+            break;
+        hal.wait_for_event();
     }
 
     // if it wasn't a proper press (50ms or more), return to regular mode
@@ -237,8 +326,7 @@ void run_config_mode() {
     set_led_prog_mode(mode);
 
     while (true) {
-        hal.poll();
-        power_sink.poll();
+        dispatcher.run();
 
         if (hal.has_button_been_pressed()) {
             // Button has been pressed and released -> switch to next mode
@@ -251,6 +339,9 @@ void run_config_mode() {
             // Button has been pressed for a long time -> save selected voltage
             save_mode(mode); // will not return
         }
+
+        // The blinking LED wakes the MCU regularly to check for a long press
+        hal.wait_for_event();
     }
 }
 
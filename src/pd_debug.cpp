@@ -12,10 +12,14 @@
 
 #if defined(PD_DEBUG)
 
+#include "dispatcher.h"
+#include "hal.h"
+
 #include <libopencm3/cm3/nvic.h>
 #include <libopencm3/stm32/dma.h>
 #include <libopencm3/stm32/gpio.h>
 #include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/syscfg.h>
 #include <libopencm3/stm32/usart.h>
 #include <stdio.h>
 #include <string.h>
@@ -26,6 +30,15 @@ namespace usb_pd {
 
 constexpr int uart_tx_buf_len = 512;
 
+#if defined(PD_I2C_HW)
+// DMA channel 2 is used for I2C; USART1 TX is remapped to channel 4
+constexpr uint8_t uart_tx_dma_channel = DMA_CHANNEL4;
+constexpr uint8_t uart_tx_dma_irq = NVIC_DMA1_CHANNEL4_7_DMA2_CHANNEL3_5_IRQ;
+#else
+constexpr uint8_t uart_tx_dma_channel = DMA_CHANNEL2;
+constexpr uint8_t uart_tx_dma_irq = NVIC_DMA1_CHANNEL2_3_DMA2_CHANNEL1_2_IRQ;
+#endif
+
 // Buffer for data to be transmitted via UART
 //  *  0 <= head < buf_len
 //  *  0 <= tail < buf_len
@@ -43,6 +56,8 @@ static volatile int tx_size;
 
 static char format_buf[80];
 
+static int uart_baudrate;
+
 static void uart_set_baudrate(int baudrate) {
     usart_disable(USART1);
     usart_set_baudrate(USART1, baudrate);
@@ -54,6 +69,7 @@ static void uart_set_baudrate(int baudrate) {
 }
 
 static void uart_init(int baudrate) {
+    uart_baudrate = baudrate;
     tx_buf_head = tx_buf_tail = 0;
     tx_size = 0;
 
@@ -67,24 +83,28 @@ static void uart_init(int baudrate) {
     gpio_mode_setup(GPIOA, GPIO_MODE_AF, GPIO_PUPD_NONE, GPIO2);
     gpio_set_af(GPIOA, 1, GPIO2);
 
-    // configure TX DMA (DMA 1 channel 2)
+    // configure TX DMA (DMA 1 channel 2, or channel 4 if remapped)
     rcc_periph_clock_enable(RCC_DMA1);
+#if defined(PD_I2C_HW)
+    rcc_periph_clock_enable(RCC_SYSCFG_COMP);
+    SYSCFG_CFGR1 |= SYSCFG_CFGR1_USART1_TX_DMA_RMP;
+#endif
 
     // enable DMA interrupt (notifying about a completed transmission)
-    nvic_set_priority(NVIC_DMA1_CHANNEL2_3_DMA2_CHANNEL1_2_IRQ, 2 << 6);
-    nvic_enable_irq(NVIC_DMA1_CHANNEL2_3_DMA2_CHANNEL1_2_IRQ);
+    nvic_set_priority(uart_tx_dma_irq, 2 << 6);
+    nvic_enable_irq(uart_tx_dma_irq);
 
-    dma_channel_reset(DMA1, DMA_CHANNEL2);
-    dma_set_priority(DMA1, DMA_CHANNEL2, DMA_CCR_PL_LOW);
+    dma_channel_reset(DMA1, uart_tx_dma_channel);
+    dma_set_priority(DMA1, uart_tx_dma_channel, DMA_CCR_PL_LOW);
 
-    dma_set_memory_size(DMA1, DMA_CHANNEL2, DMA_CCR_MSIZE_8BIT);
-    dma_set_peripheral_size(DMA1, DMA_CHANNEL2, DMA_CCR_PSIZE_8BIT);
-    dma_enable_memory_increment_mode(DMA1, DMA_CHANNEL2);
-    dma_set_read_from_memory(DMA1, DMA_CHANNEL2);
+    dma_set_memory_size(DMA1, uart_tx_dma_channel, DMA_CCR_MSIZE_8BIT);
+    dma_set_peripheral_size(DMA1, uart_tx_dma_channel, DMA_CCR_PSIZE_8BIT);
+    dma_enable_memory_increment_mode(DMA1, uart_tx_dma_channel);
+    dma_set_read_from_memory(DMA1, uart_tx_dma_channel);
 
-    dma_set_peripheral_address(DMA1, DMA_CHANNEL2, (uint32_t)&USART1_TDR);
+    dma_set_peripheral_address(DMA1, uart_tx_dma_channel, (uint32_t)&USART1_TDR);
 
-    dma_enable_transfer_complete_interrupt(DMA1, DMA_CHANNEL2);
+    dma_enable_transfer_complete_interrupt(DMA1, uart_tx_dma_channel);
 
     usart_set_mode(USART1, USART_MODE_TX);
     uart_set_baudrate(baudrate);
@@ -93,12 +113,12 @@ static void uart_init(int baudrate) {
 
 static void uart_start_tx_dma(const uint8_t* buf, int len) {
     // set transmit chunk
-    dma_set_memory_address(DMA1, DMA_CHANNEL2, (uint32_t)buf);
-    dma_set_number_of_data(DMA1, DMA_CHANNEL2, len);
+    dma_set_memory_address(DMA1, uart_tx_dma_channel, (uint32_t)buf);
+    dma_set_number_of_data(DMA1, uart_tx_dma_channel, len);
 
     // start transmission
     usart_enable_tx_dma(USART1);
-    dma_enable_channel(DMA1, DMA_CHANNEL2);
+    dma_enable_channel(DMA1, uart_tx_dma_channel);
 }
 
 static void uart_start_transmit() {
@@ -175,19 +195,57 @@ void debug_init() {
 }
 
 void debug_log(const char* msg, uint32_t val) {
+    // `format_buf` is shared: no output from interrupt handlers
+    if (hal.is_in_interrupt_handler())
+        return;
+
     int len = snprintf(format_buf, sizeof(format_buf), msg, val);
     uart_transmit((const uint8_t*)format_buf, len);
 }
 
+int debug_tx_space() {
+    int space = tx_buf_tail - tx_buf_head - 1;
+    if (space < 0)
+        space += uart_tx_buf_len;
+    return space;
+}
+
+bool debug_is_tx_idle() {
+    return tx_size == 0 && tx_buf_head == tx_buf_tail && usart_get_flag(USART1, USART_ISR_TC);
+}
+
+void debug_begin_clock_change() {
+    // Pause DMA and wait until the bytes already passed to the UART have been sent
+    usart_disable_tx_dma(USART1);
+    while (!usart_get_flag(USART1, USART_ISR_TC))
+        ;
+}
+
+void debug_end_clock_change() {
+    // Baud rate is derived from the peripheral clock
+    uart_set_baudrate(uart_baudrate);
+
+    // Resume DMA (if a transmission is in progress)
+    if (tx_size != 0)
+        usart_enable_tx_dma(USART1);
+}
+
 } // namespace usb_pd
 
+#if defined(PD_I2C_HW)
+extern "C" void dma1_channel4_7_dma2_channel3_5_isr(void) {
+#else
 extern "C" void dma1_channel2_3_dma2_channel1_2_isr(void) {
-    if (dma_get_interrupt_flag(DMA1, DMA_CHANNEL2, DMA_TCIF)) {
+#endif
+    if (dma_get_interrupt_flag(DMA1, usb_pd::uart_tx_dma_channel, DMA_TCIF)) {
         // Disable DMA
-        dma_disable_channel(DMA1, DMA_CHANNEL2);
-        dma_clear_interrupt_flags(DMA1, DMA_CHANNEL2, DMA_TCIF);
+        dma_disable_channel(DMA1, usb_pd::uart_tx_dma_channel);
+        dma_clear_interrupt_flags(DMA1, usb_pd::uart_tx_dma_channel, DMA_TCIF);
 
         usb_pd::uart_on_tx_complete();
+
+        // more output might be pending
+        usb_pd::dispatcher.signal(usb_pd::subsystem::debug_output);
     }
 }
 
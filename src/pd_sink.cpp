@@ -10,14 +10,26 @@
 
 #include "pd_sink.h"
 
+#include "dispatcher.h"
 #include "hal.h"
 #include "pd_debug.h"
+#include "timer_service.h"
 
 #include <string.h>
 
 namespace usb_pd {
 
-static char version_id[24];
+// Time to wait for Accept or Reject after a request has been sent (tSenderResponse)
+constexpr uint32_t sender_response_ms = 27;
+
+// Time to wait for PS_RDY after Accept (tPSTransition)
+constexpr uint32_t ps_transition_ms = 500;
+
+// Time to wait before resending a request after the source has replied with Wait (tSinkRequest)
+constexpr uint32_t sink_request_ms = 100;
+
+// Time to wait for Source_Capabilities after a soft reset (tTypeCSinkWaitCap, 310 to 620ms)
+constexpr uint32_t sink_wait_cap_ms = 620;
 
 void pd_sink::init() {
     pd_controller.init();
@@ -52,14 +64,50 @@ void pd_sink::poll() {
         case event_kind::message_received:
             handle_msg(evt.msg_header, evt.msg_payload);
             break;
+        case event_kind::hard_reset:
+            // Source reverts to 5V
+            active_voltage = 5000;
+            active_max_current = 900;
+            awaiting = awaited_response::none;
+            start_reset_recovery();
+            break;
+        case event_kind::tx_sent:
+            on_tx_sent(evt.msg_header);
+            break;
+        case event_kind::tx_failed:
+            on_tx_failed(evt.msg_header);
+            break;
         default:
             break;
         }
     }
+}
 
-    // check if it is time to re-request PPS voltage
-    if (selected_pps_index != -1 && requested_voltage == 0 && hal.has_expired(next_pps_request))
-        request_power_from_capability(selected_pps_index, active_voltage, active_max_current);
+void pd_sink::on_pps_timer(void* context) {
+    pd_sink* sink = static_cast<pd_sink*>(context);
+    if (sink->selected_pps_index == -1)
+        return;
+
+    if (sink->requested_voltage != 0) {
+        // request in progress; check again later
+        timers.start(sink->pps_timer, 100);
+        return;
+    }
+
+    // re-request PPS voltage
+    sink->request_power_from_capability(sink->selected_pps_index, sink->active_voltage, sink->active_max_current);
+    dispatcher.signal(subsystem::pd_ctrl);
+}
+
+void pd_sink::on_wait_timer(void* context) {
+    pd_sink* sink = static_cast<pd_sink*>(context);
+
+    // skip if the request has been superseded or cleared by a reset
+    if (sink->requested_voltage == 0 || sink->awaiting != awaited_response::none)
+        return;
+
+    sink->pd_controller.send_message(sink->request_header, sink->request_payload);
+    dispatcher.signal(subsystem::pd_ctrl);
 }
 
 void pd_sink::handle_msg(uint16_t header, const uint8_t* payload) {
@@ -71,21 +119,57 @@ void pd_sink::handle_msg(uint16_t header, const uint8_t* payload) {
         handle_src_cap_msg(header, payload);
         break;
     case pd_msg_type_ctrl_accept:
+        if (awaiting == awaited_response::soft_reset_accept) {
+            // source will send its capabilities next
+            await_response(awaited_response::source_caps, sink_wait_cap_ms);
+            break;
+        }
+        if (awaiting != awaited_response::accept)
+            break; // not requested
+        await_response(awaited_response::ps_ready, ps_transition_ms);
         notify(callback_event::power_accepted);
         break;
     case pd_msg_type_ctrl_reject:
+        awaiting = awaited_response::none;
         requested_voltage = 0;
         requested_max_current = 0;
         selected_pps_index = -1;
+        is_recovering = false;
+        contract_index = -1;
         notify(callback_event::power_rejected);
         break;
+    case pd_msg_type_ctrl_wait:
+        if (awaiting != awaited_response::accept)
+            break;
+        // source cannot meet the request now; the request is kept and resent later
+        awaiting = awaited_response::none;
+        timers.cancel(response_timer);
+        timers.start(wait_timer, sink_request_ms);
+        break;
     case pd_msg_type_ctrl_ps_ready:
+        awaiting = awaited_response::none;
         active_voltage = requested_voltage;
         active_max_current = requested_max_current;
         requested_voltage = 0;
         requested_max_current = 0;
+        contract_index = requested_index;
+        if (contract_index != -1)
+            contract_cap = source_caps[contract_index];
+        contract_voltage = active_voltage;
+        contract_max_current = active_max_current;
+        if (is_recovering) {
+            is_recovering = false;
+            reset_recovery_time = hal.millis() - reset_time;
+            DEBUG_LOG("Reset recovery: %lu ms\r\n", reset_recovery_time);
+        }
         notify(callback_event::power_ready);
         break;
+    case pd_msg_type_ctrl_soft_reset:
+        pd_controller.reset_protocol();
+        pd_controller.send_header_message(pd_msg_type_ctrl_accept);
+        start_reset_recovery();
+        await_response(awaited_response::source_caps, sink_wait_cap_ms);
+        break;
     default:
         break;
     }
@@ -94,6 +178,10 @@ void pd_sink::handle_msg(uint16_t header, const uint8_t* payload) {
 void pd_sink::handle_src_cap_msg(uint16_t header, const uint8_t* payload) {
     int n = pd_header::num_data_objs(header);
 
+    // A new negotiation starts
+    awaiting = awaited_response::none;
+    timers.cancel(response_timer);
+
     num_source_caps = 0;
     is_unconstrained = false;
     supports_ext_message = false;
@@ -138,19 +226,98 @@ void pd_sink::handle_src_cap_msg(uint16_t header, const uint8_t* payload) {
         num_source_caps++;
     }
 
+    // After a reset, immediately request the previous contract if still offered
+    if (is_recovering && contract_index != -1 && contract_index < num_source_caps) {
+        const source_capability& cap = source_caps[contract_index];
+        if (cap.supply_type == contract_cap.supply_type && cap.obj_pos == contract_cap.obj_pos
+            && cap.voltage == contract_cap.voltage && cap.min_voltage == contract_cap.min_voltage
+            && cap.max_current == contract_cap.max_current
+            && request_power_from_capability(contract_index, contract_voltage, contract_max_current) != -1)
+            return;
+    }
+
     notify(callback_event::source_caps_changed);
 }
 
+void pd_sink::on_tx_sent(uint16_t header) {
+    pd_msg_type type = pd_header::message_type(header);
+    if (type == pd_msg_type_data_request)
+        await_response(awaited_response::accept, sender_response_ms);
+    else if (type == pd_msg_type_ctrl_soft_reset)
+        await_response(awaited_response::soft_reset_accept, sender_response_ms);
+}
+
+void pd_sink::on_tx_failed(uint16_t header) {
+    pd_msg_type type = pd_header::message_type(header);
+    DEBUG_LOG("TX failed: msg ID %d\r\n", pd_header::message_id(header));
+
+    // The FUSB302B has already retried the transmission
+    if (type == pd_msg_type_data_request) {
+        send_soft_reset();
+    } else if (type == pd_msg_type_ctrl_soft_reset) {
+        send_hard_reset();
+    }
+}
+
+void pd_sink::on_response_timer(void* context) {
+    pd_sink* sink = static_cast<pd_sink*>(context);
+    if (sink->awaiting != awaited_response::none) {
+        sink->on_response_timeout();
+        dispatcher.signal(subsystem::pd_ctrl);
+    }
+}
+
+void pd_sink::on_response_timeout() {
+    DEBUG_LOG("%lu: No response\r\n", hal.millis());
+
+    if (awaiting == awaited_response::accept)
+        send_soft_reset();
+    else
+        send_hard_reset();
+}
+
+void pd_sink::await_response(awaited_response response, uint32_t timeout) {
+    awaiting = response;
+    timers.start(response_timer, timeout);
+}
+
+void pd_sink::send_soft_reset() {
+    awaiting = awaited_response::none;
+    pd_controller.reset_protocol();
+    pd_controller.send_header_message(pd_msg_type_ctrl_soft_reset);
+    start_reset_recovery();
+}
+
+void pd_sink::send_hard_reset() {
+    awaiting = awaited_response::none;
+    requested_voltage = 0;
+    requested_max_current = 0;
+    pd_controller.send_hard_reset();
+}
+
+void pd_sink::start_reset_recovery() {
+    requested_voltage = 0;
+    requested_max_current = 0;
+    selected_pps_index = -1;
+    is_recovering = true;
+    reset_time = hal.millis();
+}
+
 bool pd_sink::update_protocol() {
     auto old_protocol = protocol_;
 
     if (pd_controller.state() == fusb302_state::usb_pd) {
         protocol_ = pd_protocol::usb_pd;
+    } else if (is_recovering && pd_controller.state() == fusb302_state::usb_pd_wait) {
+        // Keep source capabilities and contract while recovering from a reset
     } else {
         protocol_ = pd_protocol::usb_20;
         active_voltage = 5000;
         active_max_current = 900;
         num_source_caps = 0;
+        is_recovering = false;
+        contract_index = -1;
+        awaiting = awaited_response::none;
     }
 
     return protocol_ != old_protocol;
@@ -213,11 +380,18 @@ int pd_sink::request_power_from_capability(int index, int voltage, int max_curre
     } else {
         set_request_payload_pps(payload, cap->obj_pos, voltage, max_current);
         selected_pps_index = index;
-        next_pps_request = hal.millis() + 8000;
+        timers.start(pps_timer, 8000);
     }
 
+    requested_index = index;
     uint16_t header = pd_header::create_data(pd_msg_type_data_request, 1, spec_rev);
 
+    // Keep request for resending it
+    request_header = header;
+    memcpy(request_payload, payload, sizeof(request_payload));
+    awaiting = awaited_response::none;
+    timers.cancel(wait_timer);
+
     // Send message
     pd_controller.send_message(header, payload);
 
@@ -0,0 +1,82 @@
+//
+// USB Power Delivery Sink Using FUSB302B
+// Copyright (c) 2020 Manuel Bleichenbacher
+//
+// Licensed under MIT License
+// https://opensource.org/licenses/MIT
+//
+// Software timers
+//
+
+#include "timer_service.h"
+
+#include "hal.h"
+
+namespace usb_pd {
+
+void timer_service::start(sw_timer& timer, uint32_t ms) {
+    start_us(timer, static_cast<uint64_t>(ms) * 1000);
+}
+
+void timer_service::start_us(sw_timer& timer, uint64_t us) {
+    remove(timer);
+
+    timer.deadline = hal.micros() + us;
+    timer.is_active_ = true;
+
+    // Insert after all timers with the same or an earlier deadline
+    sw_timer** link = &first;
+    while (*link != nullptr && (*link)->deadline <= timer.deadline)
+        link = &(*link)->next;
+    timer.next = *link;
+    *link = &timer;
+    update_next_deadline();
+}
+
+void timer_service::cancel(sw_timer& timer) {
+    remove(timer);
+}
+
+void timer_service::remove(sw_timer& timer) {
+    if (!timer.is_active_)
+        return;
+
+    sw_timer** link = &first;
+    while (*link != &timer)
+        link = &(*link)->next;
+    *link = timer.next;
+
+    timer.next = nullptr;
+    timer.is_active_ = false;
+    update_next_deadline();
+}
+
+void timer_service::update_next_deadline() {
+    // The 64 bit deadline is written in two parts: it is invalid in between
+    has_deadline = false;
+    if (first != nullptr) {
+        next_deadline_us = first->deadline;
+        has_deadline = true;
+    }
+}
+
+bool timer_service::is_due(uint64_t now) {
+    return has_deadline && now >= next_deadline_us;
+}
+
+void timer_service::poll() {
+    uint64_t now = hal.micros();
+
+    // Callbacks might start or cancel timers; so restart from the list head each time
+    while (first != nullptr && first->deadline <= now) {
+        sw_timer* timer = first;
+        remove(*timer);
+        timer->callback(timer->context);
+    }
+}
+
+uint64_t timer_service::next_deadline() {
+    return first != nullptr ? first->deadline : no_deadline;
+}
+
+} // namespace usb_pd
@@ -0,0 +1,97 @@
+//
+// USB Power Delivery Sink Using FUSB302B
+// Copyright (c) 2020 Manuel Bleichenbacher
+//
+// Licensed under MIT License
+// https://opensource.org/licenses/MIT
+//
+// Host test: timing model of I2C bit banging
+//
+
+#include <stdio.h>
+#include <unity.h>
+
+#include "i2c_bit_bang_timing.h"
+
+using namespace usb_pd;
+
+// System clocks (see `mcu_hal::set_clock_speed()`) and bus speeds (see `PD_I2C_SPEED_KHZ`)
+static const uint32_t cpu_freqs[] = {8000000, 48000000};
+static const uint32_t bus_freqs[] = {100000, 400000, 1000000};
+
+void setUp() {}
+
+void tearDown() {}
+
+// Prints SCL period and throughput for all configurations (visible with `pio test -v`)
+void test_report() {
+    char line[100];
+    TEST_MESSAGE("CPU MHz  bus kHz  loops  SCL ns  SCL kHz  exp. kHz  bytes/s");
+    for (uint32_t cpu_freq : cpu_freqs) {
+        for (uint32_t bus_freq : bus_freqs) {
+            uint32_t period_ns = i2c_bit_bang_timing::scl_period_ns(cpu_freq, bus_freq);
+            snprintf(line, sizeof(line), "%7lu  %7lu  %5lu  %6lu  %7lu  %8lu  %7lu", (unsigned long)(cpu_freq / 1000000),
+                     (unsigned long)(bus_freq / 1000),
+                     (unsigned long)i2c_bit_bang_timing::delay_loops(cpu_freq, bus_freq),
+                     (unsigned long)period_ns, (unsigned long)(1000000 / period_ns),
+                     (unsigned long)(cpu_freq / i2c_bit_bang_timing::expected_scl_period_cycles(cpu_freq, bus_freq)
+                                     / 1000),
+                     (unsigned long)i2c_bit_bang_timing::bytes_per_second(cpu_freq, bus_freq));
+            TEST_MESSAGE(line);
+        }
+    }
+}
+
+// A delay loop with n iterations takes 4n - 2 cycles (last BNE not taken)
+void test_delay_loop_cycles() {
+    for (uint32_t loops = 1; loops <= 100; loops++)
+        TEST_ASSERT_EQUAL_UINT32(i2c_bit_bang_timing::phase_overhead_cycles + 4 * loops - 2,
+                                 i2c_bit_bang_timing::phase_cycles(loops));
+}
+
+// The bus must never run faster than configured
+void test_never_faster_than_bus_speed() {
+    for (uint32_t cpu_freq : cpu_freqs) {
+        for (uint32_t bus_freq : bus_freqs)
+            TEST_ASSERT_GREATER_OR_EQUAL_UINT32(1000000000 / bus_freq,
+                                                i2c_bit_bang_timing::scl_period_ns(cpu_freq, bus_freq));
+    }
+}
+
+// Flash wait states only lengthen the period
+void test_wait_states() {
+    TEST_ASSERT_EQUAL_UINT32(i2c_bit_bang_timing::scl_period_cycles(8000000, 400000),
+                             i2c_bit_bang_timing::expected_scl_period_cycles(8000000, 400000));
+    for (uint32_t bus_freq : bus_freqs)
+        TEST_ASSERT_GREATER_THAN_UINT32(i2c_bit_bang_timing::scl_period_cycles(48000000, bus_freq),
+                                        i2c_bit_bang_timing::expected_scl_period_cycles(48000000, bus_freq));
+}
+
+// At 48MHz, the bus should not be slower than necessary (one delay loop iteration per phase)
+void test_close_to_bus_speed() {
+    for (uint32_t bus_freq : bus_freqs) {
+        uint32_t period_cycles = i2c_bit_bang_timing::scl_period_cycles(48000000, bus_freq);
+        uint32_t target_cycles = 48000000 / bus_freq;
+        if (target_cycles > 2 * (i2c_bit_bang_timing::phase_overhead_cycles + i2c_bit_bang_timing::loop_cycles))
+            TEST_ASSERT_LESS_OR_EQUAL_UINT32(target_cycles + 2 * i2c_bit_bang_timing::loop_cycles, period_cycles);
+    }
+}
+
+// A throughput figure is consistent with the SCL period (9 SCL periods per byte)
+void test_bytes_per_second() {
+    TEST_ASSERT_EQUAL_UINT32(48000000 / (9 * i2c_bit_bang_timing::scl_period_cycles(48000000, 400000)),
+                             i2c_bit_bang_timing::bytes_per_second(48000000, 400000));
+    TEST_ASSERT_GREATER_OR_EQUAL_UINT32(i2c_bit_bang_timing::bytes_per_second(48000000, 400000),
+                                        i2c_bit_bang_timing::bytes_per_second(48000000, 1000000));
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_report);
+    RUN_TEST(test_delay_loop_cycles);
+    RUN_TEST(test_never_faster_than_bus_speed);
+    RUN_TEST(test_wait_states);
+    RUN_TEST(test_close_to_bus_speed);
+    RUN_TEST(test_bytes_per_second);
+    return UNITY_END();
+}
@@ -0,0 +1,106 @@
+//
+// USB Power Delivery Sink Using FUSB302B
+// Copyright (c) 2020 Manuel Bleichenbacher
+//
+// Licensed under MIT License
+// https://opensource.org/licenses/MIT
+//
+// Host test: lock-free queue
+//
+
+#include <stdio.h>
+#include <thread>
+#include <unity.h>
+
+#include "queue.h"
+
+using namespace usb_pd;
+
+struct item {
+    unsigned seq;
+    unsigned check;
+};
+
+static unsigned check_value(unsigned seq) {
+    return seq * 2654435761u;
+}
+
+void setUp() {}
+
+void tearDown() {}
+
+// Items are returned in FIFO order; a full queue rejects items without counting them as dropped
+void test_fifo_and_full() {
+    queue<int, 4> q;
+    for (int i = 0; i < 4; i++)
+        TEST_ASSERT_TRUE(q.try_push(i));
+    TEST_ASSERT_FALSE(q.try_push(4));
+    TEST_ASSERT_FALSE(q.emplace(5));
+    TEST_ASSERT_EQUAL(0, q.drops());
+    TEST_ASSERT_EQUAL(4, q.high_water());
+
+    int value;
+    for (int i = 0; i < 4; i++) {
+        TEST_ASSERT_TRUE(q.try_pop(value));
+        TEST_ASSERT_EQUAL(i, value);
+    }
+    TEST_ASSERT_FALSE(q.try_pop(value));
+}
+
+// Only `add_item()` discards items and counts them
+void test_drops() {
+    queue<int, 2> q;
+    q.add_item(1);
+    q.add_item(2);
+    q.add_item(3);
+    TEST_ASSERT_EQUAL(1, q.drops());
+    TEST_ASSERT_EQUAL(1, q.pop_item());
+    TEST_ASSERT_EQUAL(2, q.pop_item());
+    TEST_ASSERT_EQUAL(0, q.num_items());
+}
+
+// A producer and a consumer thread pass items through a small queue:
+// no item is lost, duplicated, reordered or torn.
+void test_two_threads() {
+    static queue<item, 8> q;
+    const unsigned num_items = 200000;
+
+    std::thread producer([num_items]() {
+        for (unsigned i = 0; i < num_items;) {
+            if (q.emplace(item{i, check_value(i)}))
+                i++;
+            else
+                std::this_thread::yield();
+        }
+    });
+
+    unsigned expected = 0;
+    unsigned num_bad = 0;
+    item it;
+    while (expected < num_items) {
+        if (q.try_pop(it)) {
+            if (it.seq != expected || it.check != check_value(expected))
+                num_bad++;
+            expected++;
+        } else {
+            std::this_thread::yield();
+        }
+    }
+    producer.join();
+
+    char line[80];
+    snprintf(line, sizeof(line), "items: %u, high water: %d", num_items, q.high_water());
+    TEST_MESSAGE(line);
+
+    TEST_ASSERT_EQUAL(0, num_bad);
+    TEST_ASSERT_EQUAL(0, q.num_items());
+    TEST_ASSERT_EQUAL(0, q.drops());
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_fifo_and_full);
+    RUN_TEST(test_drops);
+    RUN_TEST(test_two_threads);
+    return UNITY_END();
+}
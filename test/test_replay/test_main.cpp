@@ -0,0 +1,929 @@
+//
+// USB Power Delivery Sink Using FUSB302B
+// Copyright (c) 2020 Manuel Bleichenbacher
+//
+// Licensed under MIT License
+// https://opensource.org/licenses/MIT
+//
+// Host test: replay of recorded I2C traces through fusb302 and pd_sink
+//
+// Besides the built-in traces, captured debug output of `i2c_recorder`
+// can be replayed by passing the file names (or `-` for stdin):
+//
+//     pio test -e native_replay -a capture.log
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <unity.h>
+#include <vector>
+
+#include "dispatcher.h"
+#include "fusb302_regs.h"
+#include "hal.h"
+#include "pd_sink.h"
+#include "timer_service.h"
+
+using namespace usb_pd;
+
+// Built-in traces in the format of `i2c_recorder` (see i2c_recorder.h)
+
+// Source attaches on CC1 and offers 5V/3A and 9V/2A. The sink requests 9V.
+// The source replies with Wait, then accepts the repeated request.
+static const char* const wait_then_accept_trace[] = {
+    // init(): shadow registers, device ID
+    "@10050 0:R02 03203160240002060001000f000000",
+    "@10100 0:R01 91",
+    // CC measurement: CC1 connected
+    "@20150 0:R40 01",
+    "@20200 0:R40 01",
+    // CC debounced, VBUS present
+    "@120250 0:R40 81",
+    // Source_Capabilities (5V/3A, 9V/2A)
+    "@150000 0:R3c 00000000810810",
+    "@150100 0:R43 e06121",
+    "@150200 0:R43 2c910100c8d0020011223344",
+    "@150300 0:R40 9128",
+    // Request (9V, 2A)
+    "@150350 0:W43 12121213864210c8200323ff14fea1",
+    "@151500 0:R3c 00000400812800",
+    // Wait
+    "@160000 0:R3c 00000000810810",
+    "@160100 0:R43 e06c03",
+    "@160200 0:R43 11223344",
+    "@160300 0:R40 9128",
+    // Repeated request after tSinkRequest
+    "@260350 0:W43 12121213864212c8200323ff14fea1",
+    "@261500 0:R3c 00000400812800",
+    // Accept
+    "@265000 0:R3c 00000000810810",
+    "@265100 0:R43 e06305",
+    "@265200 0:R43 11223344",
+    "@265300 0:R40 9128",
+    // PS_RDY
+    "@400000 0:R3c 00000000810810",
+    "@400100 0:R43 e06607",
+    "@400200 0:R43 11223344",
+    "@400300 0:R40 9128",
+};
+
+// Same source, but it rejects the request. The sink keeps 5V.
+static const char* const reject_trace[] = {
+    "@10050 0:R02 03203160240002060001000f000000",
+    "@10100 0:R01 91",
+    "@20150 0:R40 01",
+    "@20200 0:R40 01",
+    "@120250 0:R40 81",
+    // Source_Capabilities (5V/3A, 9V/2A)
+    "@150000 0:R3c 00000000810810",
+    "@150100 0:R43 e06121",
+    "@150200 0:R43 2c910100c8d0020011223344",
+    "@150300 0:R40 9128",
+    // Request (9V, 2A)
+    "@150350 0:W43 12121213864210c8200323ff14fea1",
+    "@151500 0:R3c 00000400812800",
+    // Reject
+    "@160000 0:R3c 00000000810810",
+    "@160100 0:R43 e06403",
+    "@160200 0:R43 11223344",
+    "@160300 0:R40 9128",
+};
+
+// The request cannot be written to the TX FIFO. The sink flushes the
+// TX FIFO and sends a soft reset.
+static const char* const tx_failure_trace[] = {
+    "@10050 0:R02 03203160240002060001000f000000",
+    "@10100 0:R01 91",
+    "@20150 0:R40 01",
+    "@20200 0:R40 01",
+    "@120250 0:R40 81",
+    // Source_Capabilities (5V/3A, 9V/2A)
+    "@150000 0:R3c 00000000810810",
+    "@150100 0:R43 e06121",
+    "@150200 0:R43 2c910100c8d0020011223344",
+    "@150300 0:R40 9128",
+    // Request (9V, 2A): I2C failure
+    "@150350 0:W43! 12121213864210c8200323ff14fea1",
+    // Soft_Reset
+    "@150400 0:W43 12121213824d00ff14fea1",
+};
+
+// The source sends Soft_Reset and the sink accepts it, but the source
+// does not send its capabilities. After PS_RDY, an unrequested Accept is received.
+static const char* const soft_reset_without_caps_trace[] = {
+    "@10050 0:R02 03203160240002060001000f000000",
+    "@10100 0:R01 91",
+    "@20150 0:R40 01",
+    "@20200 0:R40 01",
+    "@120250 0:R40 81",
+    // Source_Capabilities (5V/3A, 9V/2A)
+    "@150000 0:R3c 00000000810810",
+    "@150100 0:R43 e06121",
+    "@150200 0:R43 2c910100c8d0020011223344",
+    "@150300 0:R40 9128",
+    // Request (9V, 2A)
+    "@150350 0:W43 12121213864210c8200323ff14fea1",
+    "@151500 0:R3c 00000400812800",
+    // Accept
+    "@155000 0:R3c 00000000810810",
+    "@155100 0:R43 e06303",
+    "@155200 0:R43 11223344",
+    "@155300 0:R40 9128",
+    // PS_RDY
+    "@300000 0:R3c 00000000810810",
+    "@300100 0:R43 e06605",
+    "@300200 0:R43 11223344",
+    "@300300 0:R40 9128",
+    // Accept (not requested)
+    "@310000 0:R3c 00000000810810",
+    "@310100 0:R43 e06307",
+    "@310200 0:R43 11223344",
+    "@310300 0:R40 9128",
+    // Soft_Reset
+    "@400000 0:R3c 00000000810810",
+    "@400100 0:R43 e06d01",
+    "@400200 0:R43 11223344",
+    "@400300 0:R40 9128",
+    // Accept
+    "@400350 0:W43 12121213824300ff14fea1",
+    "@401500 0:R3c 00000400812800",
+};
+
+// The request is not acknowledged (retries failed). The sink sends a soft
+// reset, which the source accepts, but the source does not send its capabilities.
+static const char* const retry_failure_trace[] = {
+    "@10050 0:R02 03203160240002060001000f000000",
+    "@10100 0:R01 91",
+    "@20150 0:R40 01",
+    "@20200 0:R40 01",
+    "@120250 0:R40 81",
+    // Source_Capabilities (5V/3A, 9V/2A)
+    "@150000 0:R3c 00000000810810",
+    "@150100 0:R43 e06121",
+    "@150200 0:R43 2c910100c8d0020011223344",
+    "@150300 0:R40 9128",
+    // Request (9V, 2A): I_RETRYFAIL
+    "@150350 0:W43 12121213864210c8200323ff14fea1",
+    "@151500 0:R3c 00001000812800",
+    // Soft_Reset
+    "@151550 0:W43 12121213824d00ff14fea1",
+    "@152500 0:R3c 00000400812800",
+    // Accept
+    "@155000 0:R3c 00000000810810",
+    "@155100 0:R43 e06301",
+    "@155200 0:R43 11223344",
+    "@155300 0:R40 9128",
+};
+
+// Two FUSB302B (FUSB302B__X at 0x22, FUSB302B01MPX at 0x23), each attached
+// to a source. Port 0 gets 9V. Port 1 is rejected. Both use their own message IDs.
+static const char* const two_ports_trace[] = {
+    "@10050 0:R02 03203160240002060001000f000000",
+    "@10100 0:R01 91",
+    "@20150 1:R02 03203160240002060001000f000000",
+    "@20200 1:R01 95",
+    "@30250 0:R40 01",
+    "@30300 0:R40 01",
+    "@30350 1:R40 01",
+    "@30400 1:R40 01",
+    "@130450 0:R40 81",
+    "@130500 1:R40 81",
+    // Source_Capabilities (5V/3A, 9V/2A) on both ports
+    "@150000 0:R3c 00000000810810",
+    "@150100 0:R43 e06121",
+    "@150200 0:R43 2c910100c8d0020011223344",
+    "@150300 0:R40 9128",
+    "@150350 0:W43 12121213864210c8200323ff14fea1",
+    "@151000 1:R3c 00000000810810",
+    "@151100 1:R43 e06121",
+    "@151200 1:R43 2c910100c8d0020011223344",
+    "@151300 1:R40 9128",
+    "@151350 1:W43 12121213864210c8200323ff14fea1",
+    "@151500 0:R3c 00000400812800",
+    "@152500 1:R3c 00000400812800",
+    // Accept on port 0, Reject on port 1
+    "@155000 0:R3c 00000000810810",
+    "@155100 0:R43 e06303",
+    "@155200 0:R43 11223344",
+    "@155300 0:R40 9128",
+    "@156000 1:R3c 00000000810810",
+    "@156100 1:R43 e06403",
+    "@156200 1:R43 11223344",
+    "@156300 1:R40 9128",
+    // PS_RDY on port 0
+    "@300000 0:R3c 00000000810810",
+    "@300100 0:R43 e06605",
+    "@300200 0:R43 11223344",
+    "@300300 0:R40 9128",
+};
+
+// Source without USB PD (PD controller only, no device ID read): CC1 is
+// connected, but no message arrives. The reset for the retry disconnects the
+// pull-down resistors. The source is found again after the retry wait.
+static const char* const non_pd_source_trace[] = {
+    "@10050 0:R02 03203160240002060001000f000000",
+    "@20150 0:R40 01",
+    "@20200 0:R40 01",
+    "@120250 0:R40 81",
+    // No USB PD message within 300ms: reset and retry wait (300ms)
+    "@330250 0:R02 03203160240002060001000f000000",
+    "@640300 0:R40 01",
+    "@640350 0:R40 01",
+    "@740400 0:R40 81",
+};
+
+// Same source, but it is removed during the retry wait
+static const char* const removed_non_pd_source_trace[] = {
+    "@10050 0:R02 03203160240002060001000f000000",
+    "@20150 0:R40 01",
+    "@20200 0:R40 01",
+    "@120250 0:R40 81",
+    "@330250 0:R02 03203160240002060001000f000000",
+    // Neither CC1 nor CC2 connected
+    "@640300 0:R40 00",
+    "@640350 0:R40 00",
+    "@650400 0:R40 00",
+    "@650450 0:R40 00",
+};
+
+// Frame with an invalid token (PD controller only): the RX FIFO is flushed
+static const char* const invalid_token_trace[] = {
+    "@10050 0:R02 03203160240002060001000f000000",
+    "@20150 0:R40 01",
+    "@20200 0:R40 01",
+    "@120250 0:R40 81",
+    "@150000 0:R3c 00000000810810",
+    "@150100 0:R43 206121",
+};
+
+// Excerpt of captured debug output (with line breaks, other debug messages,
+// a 32-bit time wrap-around and the 5V request of the firmware)
+static const char* const captured_log = "FUSB302 ver ID:B_revA\r\n"
+                                        "@4294957296 0:R02 03203160240002060001000f000000\r\n"
+                                        "@4294957346 0:R01 91\r\n"
+                                        "I2C SCL period: 2541 ns\r\n"
+                                        "@4294967246 0:R40 01\r\n"
+                                        "@4 0:R40 01\r\n"
+                                        "@100054 0:R40 81\r\n"
+                                        "@129804 0:R3c 00000000810810\r\n"
+                                        "@129904 0:R43 e06121\r\n"
+                                        "@130004 0:R43 2c910100c8d0020011223344\r\n"
+                                        "@130104 0:R40 9128\r\n"
+                                        "@130154 0:W43 121212138642102cb10413ff14fea1\r\n"
+                                        "@131304 0:R3c 00000400812800\r\n";
+
+struct trace_entry {
+    uint64_t time;
+    int port;
+    bool is_write;
+    uint8_t reg;
+    bool failed;
+    std::vector<uint8_t> data;
+};
+
+struct trace {
+    std::vector<trace_entry> entries;
+    /// Number of accesses lost by the recorder (the trace cannot be replayed)
+    unsigned long lost = 0;
+    /// Description of the first malformed line (empty if none)
+    std::string error;
+};
+
+// Maximum number of PD controllers (ports 0 and 1 stand for FUSB302B
+// with different I2C addresses, see `pd_ports` in hal.cpp)
+constexpr int max_ports = 2;
+
+// Replay state of a PD controller and its sink
+struct port_replay {
+    /// Next recorded read
+    size_t read_pos;
+    /// Next recorded FIFO write
+    size_t write_pos;
+    /// Register contents known from recorded reads and from writes
+    uint8_t regs[256];
+    /// Events reported by the sink
+    std::vector<callback_event> events;
+    /// Times of the transmitted messages (in µs)
+    std::vector<uint64_t> tx_times_us;
+    /// Times of the hard resets sent (in µs)
+    std::vector<uint64_t> hard_reset_times_us;
+    /// Sink under test (recreated for every replay)
+    pd_sink* sink;
+    /// PD controller under test if the replay is without sink (see `replay()`)
+    fusb302* ctrl;
+    /// Events reported by the PD controller under test
+    std::vector<event_kind> ctrl_events;
+};
+
+static trace rec;
+
+static port_replay ports[max_ports];
+
+// Number of PD controllers in the trace
+static int num_ports;
+
+// Current time (in µs)
+static uint64_t now_us;
+
+static int num_divergences;
+
+// Number of command writes (e.g. TX_FLUSH) that changed the register configuration
+static int num_clobbered_regs;
+
+mcu_hal usb_pd::hal;
+
+timer_service usb_pd::timers;
+
+event_dispatcher usb_pd::dispatcher;
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+enum class line_kind { access, lost, other, malformed };
+
+// Parses a line "@<time> <port>:<dir><reg>[!] <data>" or "@<time> lost <n>"
+static line_kind parse_line(const std::string& line, trace_entry& entry, unsigned long& num_lost) {
+    const char* p = line.c_str();
+    if (*p != '@')
+        return line_kind::other;
+
+    char* end;
+    entry.time = strtoul(p + 1, &end, 10);
+    if (*end != ' ')
+        return line_kind::malformed;
+    p = end + 1;
+
+    if (strncmp(p, "lost ", 5) == 0) {
+        num_lost = strtoul(p + 5, nullptr, 10);
+        return line_kind::lost;
+    }
+
+    entry.port = static_cast<int>(strtoul(p, &end, 10));
+    if (end == p || end[0] != ':' || (end[1] != 'R' && end[1] != 'W') || hex_value(end[2]) < 0
+        || hex_value(end[3]) < 0)
+        return line_kind::malformed;
+    entry.is_write = end[1] == 'W';
+    entry.reg = static_cast<uint8_t>(hex_value(end[2]) << 4 | hex_value(end[3]));
+    p = end + 4;
+    entry.failed = *p == '!';
+    if (entry.failed)
+        p++;
+
+    entry.data.clear();
+    while (*p != 0) {
+        if (*p == ' ' || *p == '\r' || *p == '\n') {
+            p++;
+            continue;
+        }
+        int hi = hex_value(p[0]);
+        int lo = hi >= 0 ? hex_value(p[1]) : -1;
+        if (lo < 0)
+            return line_kind::malformed;
+        entry.data.push_back(static_cast<uint8_t>(hi << 4 | lo));
+        p += 2;
+    }
+    return line_kind::access;
+}
+
+// Adds a line to the trace; the 32-bit timestamps are extended to 64 bits
+static void add_line(trace& t, const std::string& line) {
+    trace_entry entry;
+    unsigned long num_lost = 0;
+    switch (parse_line(line, entry, num_lost)) {
+    case line_kind::access:
+        if (!t.entries.empty()) {
+            uint64_t prev = t.entries.back().time;
+            entry.time |= prev & ~static_cast<uint64_t>(0xffffffff);
+            if (entry.time + 0x80000000 < prev)
+                entry.time += static_cast<uint64_t>(1) << 32;
+        }
+        t.entries.push_back(entry);
+        break;
+    case line_kind::lost:
+        t.lost += num_lost;
+        break;
+    case line_kind::malformed:
+        if (t.error.empty())
+            t.error = "malformed line: " + line;
+        break;
+    default:
+        break;
+    }
+}
+
+static trace load_trace(const char* const* lines, size_t num_lines) {
+    trace t;
+    for (size_t i = 0; i < num_lines; i++)
+        add_line(t, lines[i]);
+    return t;
+}
+
+// Loads captured debug output (lines not produced by the recorder are skipped)
+static trace load_trace(FILE* file) {
+    trace t;
+    std::string line;
+    int c;
+    while ((c = fgetc(file)) != EOF) {
+        if (c == '\n') {
+            add_line(t, line);
+            line.clear();
+        } else {
+            line += static_cast<char>(c);
+        }
+    }
+    if (!line.empty())
+        add_line(t, line);
+    return t;
+}
+
+static size_t next_read(int port) {
+    size_t& pos = ports[port].read_pos;
+    while (pos < rec.entries.size() && (rec.entries[pos].is_write || rec.entries[pos].port != port))
+        pos++;
+    return pos;
+}
+
+static size_t next_fifo_write(int port, size_t pos) {
+    while (pos < rec.entries.size()
+           && (!rec.entries[pos].is_write || rec.entries[pos].reg != reg_fifos || rec.entries[pos].port != port))
+        pos++;
+    return pos;
+}
+
+// Simulated hardware: reads are served from the trace, configuration writes
+// are accepted and FIFO writes (transmitted messages) must match the trace.
+
+bool mcu_hal::pd_ctrl_read(int port, uint8_t reg, int data_len, uint8_t* data) {
+    size_t pos = next_read(port);
+    if (pos >= rec.entries.size()) {
+        // end of the capture (not a divergence)
+        memset(data, 0, data_len);
+        return false;
+    }
+    if (rec.entries[pos].reg != reg || rec.entries[pos].data.size() != static_cast<size_t>(data_len)) {
+        printf("  divergence: port %d read of register 0x%02x (%d bytes) at %llu us\n", port, reg, data_len,
+               static_cast<unsigned long long>(now_us));
+        num_divergences++;
+        memset(data, 0, data_len);
+        return false;
+    }
+
+    const trace_entry& entry = rec.entries[pos];
+    if (entry.time > now_us)
+        now_us = entry.time;
+    memcpy(data, entry.data.data(), data_len);
+    if (reg != reg_fifos && !entry.failed)
+        memcpy(ports[port].regs + reg, data, data_len);
+    ports[port].read_pos++;
+    return !entry.failed;
+}
+
+// Self-clearing command bits of the CONTROLx registers
+static uint8_t command_bits(uint8_t reg) {
+    switch (reg) {
+    case reg_control0:
+        return control0_tx_flush;
+    case reg_control1:
+        return control1_rx_flush;
+    case reg_control3:
+        return control3_send_hard_reset;
+    default:
+        return 0;
+    }
+}
+
+bool mcu_hal::pd_ctrl_write(int port, uint8_t reg, int data_len, const uint8_t* data, bool) {
+    port_replay& p = ports[port];
+
+    if (reg != reg_fifos) {
+        for (int i = 0; i < data_len; i++) {
+            uint8_t mask = command_bits(reg + i);
+            if ((data[i] & mask) != 0 && (data[i] & ~mask) != (p.regs[reg + i] & ~mask)) {
+                printf("  port %d register 0x%02x changed by command write at %llu us\n", port, reg + i,
+                       static_cast<unsigned long long>(now_us));
+                num_clobbered_regs++;
+            }
+            if (reg + i == reg_control3 && (data[i] & control3_send_hard_reset) != 0)
+                p.hard_reset_times_us.push_back(now_us);
+            p.regs[reg + i] = data[i] & ~mask;
+        }
+        return true;
+    }
+
+    size_t pos = next_fifo_write(port, p.write_pos);
+    if (pos >= rec.entries.size() || rec.entries[pos].data.size() != static_cast<size_t>(data_len)
+        || memcmp(rec.entries[pos].data.data(), data, data_len) != 0) {
+        printf("  divergence: port %d transmitted message at %llu us\n", port,
+               static_cast<unsigned long long>(now_us));
+        num_divergences++;
+        return true;
+    }
+
+    p.write_pos = pos + 1;
+    p.tx_times_us.push_back(now_us);
+    return !rec.entries[pos].failed;
+}
+
+// INT_N is asserted when the recorded firmware read the interrupt status next
+bool mcu_hal::is_interrupt_asserted(int port) {
+    size_t pos = next_read(port);
+    return pos < rec.entries.size() && rec.entries[pos].reg == reg_status0a && rec.entries[pos].time <= now_us;
+}
+
+void mcu_hal::init_int_n(int) {}
+
+#if defined(PD_ISR_RX)
+
+// INT_N handlers run synchronously when triggered (e.g. by `fusb302::poll()`)
+static int_n_handler int_n_handlers[max_ports];
+static void* int_n_contexts[max_ports];
+
+void mcu_hal::set_int_n_handler(int port, int_n_handler handler, void* context) {
+    int_n_handlers[port] = handler;
+    int_n_contexts[port] = context;
+}
+
+void mcu_hal::trigger_int_n_handler(int port) {
+    if (int_n_handlers[port] != nullptr)
+        int_n_handlers[port](int_n_contexts[port]);
+}
+
+void mcu_hal::disable_interrupts() {}
+
+void mcu_hal::enable_interrupts() {}
+
+#endif
+
+void mcu_hal::enable_int_n_wakeup(int) {}
+
+uint32_t mcu_hal::millis() {
+    return static_cast<uint32_t>(now_us / 1000);
+}
+
+uint64_t mcu_hal::micros() {
+    return now_us;
+}
+
+void mcu_hal::delay(uint32_t ms) {
+    now_us += ms * 1000;
+}
+
+void mcu_hal::on_led_timer(void*) {}
+
+// Indicates if a subsystem has signaled more work (see `replay()`)
+static bool is_signaled;
+
+void event_dispatcher::signal(subsystem) {
+    is_signaled = true;
+}
+
+// Repeats the request recorded next (the firmware's choice of voltage and current)
+static void request_as_recorded(int port) {
+    size_t pos = next_fifo_write(port, ports[port].write_pos);
+    if (pos >= rec.entries.size() || rec.entries[pos].data.size() < 11)
+        return;
+
+    // SOP tokens (4), PACKSYM, header (2), request data object (4)
+    const uint8_t* msg = rec.entries[pos].data.data() + 5;
+    uint16_t header = msg[0] | msg[1] << 8;
+    if (pd_header::message_type(header) != pd_msg_type_data_request)
+        return;
+    const uint8_t* rdo = msg + 2;
+    int obj_pos = (rdo[3] >> 4) & 0x07;
+
+    pd_sink* sink = ports[port].sink;
+    for (int i = 0; i < sink->num_source_caps; i++) {
+        const source_capability& cap = sink->source_caps[i];
+        if (cap.obj_pos != obj_pos)
+            continue;
+        if (cap.supply_type == pd_supply_type::pps) {
+            int voltage = ((rdo[1] >> 1) | (rdo[2] & 0x0f) << 7) * 20;
+            sink->request_power_from_capability(i, voltage, (rdo[0] & 0x7f) * 50);
+        } else {
+            sink->request_power_from_capability(i, cap.voltage, (rdo[0] | (rdo[1] & 0x03) << 8) * 10);
+        }
+        return;
+    }
+}
+
+// The event callback has no context: one function per port
+template <int port>
+static void sink_callback(callback_event event) {
+    ports[port].events.push_back(event);
+
+    if (event == callback_event::source_caps_changed)
+        request_as_recorded(port);
+}
+
+static const pd_sink::event_callback sink_callbacks[max_ports] = {sink_callback<0>, sink_callback<1>};
+
+// Polls the PD controller under test and collects its events
+static void poll_controller(port_replay& p) {
+    while (true) {
+        p.ctrl->poll();
+        if (!p.ctrl->has_event())
+            break;
+        p.ctrl_events.push_back(p.ctrl->pop_event().kind);
+    }
+}
+
+static int count_ctrl_events(int port, event_kind kind) {
+    int n = 0;
+    for (event_kind k : ports[port].ctrl_events) {
+        if (k == kind)
+            n++;
+    }
+    return n;
+}
+
+// Runs the sinks (or the bare PD controllers if `is_controller_only` is set)
+// until the trace has been consumed and all timers due until `until_us` have
+// expired. Time advances to the next timer deadline or to the time of the
+// next recorded access, whichever comes first.
+static void replay(trace&& t, uint64_t until_us = 0, bool is_controller_only = false) {
+    rec = std::move(t);
+    now_us = 0;
+    num_divergences = 0;
+    num_clobbered_regs = 0;
+
+    num_ports = 1;
+    for (const trace_entry& entry : rec.entries) {
+        if (entry.port >= num_ports)
+            num_ports = entry.port + 1;
+    }
+    TEST_ASSERT_TRUE_MESSAGE(num_ports <= max_ports, "trace has too many ports");
+
+    timers = timer_service();
+    for (int i = 0; i < max_ports; i++) {
+        port_replay& p = ports[i];
+        p.read_pos = 0;
+        p.write_pos = 0;
+        memset(p.regs, 0, sizeof(p.regs));
+        p.events.clear();
+        p.tx_times_us.clear();
+        p.hard_reset_times_us.clear();
+        p.ctrl_events.clear();
+        delete p.sink;
+        p.sink = nullptr;
+        delete p.ctrl;
+        p.ctrl = nullptr;
+    }
+
+    for (int i = 0; i < num_ports; i++) {
+        if (is_controller_only) {
+            ports[i].ctrl = new fusb302(i);
+            ports[i].ctrl->init();
+            ports[i].ctrl->start_sink();
+        } else {
+            ports[i].sink = new pd_sink(i);
+            ports[i].sink->set_event_callback(sink_callbacks[i]);
+            ports[i].sink->init();
+        }
+    }
+
+    for (size_t step = 0; step < 100 * rec.entries.size(); step++) {
+        timers.poll();
+
+        // Poll again while there is pending work (like the event dispatcher)
+        is_signaled = true;
+        for (int n = 0; is_signaled && n < 10; n++) {
+            is_signaled = false;
+            for (int i = 0; i < num_ports; i++) {
+                if (is_controller_only)
+                    poll_controller(ports[i]);
+                else
+                    ports[i].sink->poll();
+            }
+        }
+
+        // Time of the next recorded access not yet due
+        uint64_t next = timers.next_deadline();
+        bool is_consumed = true;
+        for (int i = 0; i < num_ports; i++) {
+            size_t pos = next_read(i);
+            if (pos >= rec.entries.size())
+                continue;
+            is_consumed = false;
+            if (rec.entries[pos].time < next && rec.entries[pos].time > now_us)
+                next = rec.entries[pos].time;
+        }
+        if (is_consumed && next > until_us)
+            break;
+        if (next != timer_service::no_deadline && next > now_us)
+            now_us = next;
+    }
+}
+
+// Checks that the sinks have reproduced the recorded register accesses
+static void assert_replayed() {
+    TEST_ASSERT_EQUAL(0, num_divergences);
+    TEST_ASSERT_EQUAL(0, num_clobbered_regs);
+    for (int i = 0; i < num_ports; i++) {
+        TEST_ASSERT_EQUAL(rec.entries.size(), next_read(i));
+        TEST_ASSERT_EQUAL(rec.entries.size(), next_fifo_write(i, ports[i].write_pos));
+    }
+}
+
+void setUp() {}
+
+void tearDown() {}
+
+// A Wait reply defers the request (no soft reset); the repeated request is accepted
+void test_wait_then_accept() {
+    replay(load_trace(wait_then_accept_trace, sizeof(wait_then_accept_trace) / sizeof(wait_then_accept_trace[0])));
+    assert_replayed();
+
+    TEST_ASSERT_EQUAL(4, ports[0].events.size());
+    TEST_ASSERT_TRUE(ports[0].events[0] == callback_event::protocol_changed);
+    TEST_ASSERT_TRUE(ports[0].events[1] == callback_event::source_caps_changed);
+    TEST_ASSERT_TRUE(ports[0].events[2] == callback_event::power_accepted);
+    TEST_ASSERT_TRUE(ports[0].events[3] == callback_event::power_ready);
+
+    // The request is repeated no earlier than tSinkRequest (100ms) after Wait
+    TEST_ASSERT_EQUAL(2, ports[0].tx_times_us.size());
+    TEST_ASSERT_GREATER_OR_EQUAL_UINT32(160300 + 100000, static_cast<uint32_t>(ports[0].tx_times_us[1]));
+
+    TEST_ASSERT_TRUE(ports[0].sink->protocol() == pd_protocol::usb_pd);
+    TEST_ASSERT_EQUAL(9000, ports[0].sink->active_voltage);
+    TEST_ASSERT_EQUAL(2000, ports[0].sink->active_max_current);
+}
+
+// A rejected request keeps the 5V default
+void test_reject() {
+    replay(load_trace(reject_trace, sizeof(reject_trace) / sizeof(reject_trace[0])));
+    assert_replayed();
+
+    TEST_ASSERT_EQUAL(3, ports[0].events.size());
+    TEST_ASSERT_TRUE(ports[0].events[2] == callback_event::power_rejected);
+    TEST_ASSERT_EQUAL(5000, ports[0].sink->active_voltage);
+}
+
+// A failed TX FIFO write is flushed (without changing CONTROL0) and followed by a soft reset
+void test_tx_failure() {
+    replay(load_trace(tx_failure_trace, sizeof(tx_failure_trace) / sizeof(tx_failure_trace[0])));
+    assert_replayed();
+    // Failed request and soft reset
+    TEST_ASSERT_EQUAL(2, ports[0].tx_times_us.size());
+}
+
+// Without Source_Capabilities after a soft reset, the sink sends a hard reset
+// after tTypeCSinkWaitCap. Unrequested Accept messages are ignored.
+void test_soft_reset_without_caps() {
+    replay(load_trace(soft_reset_without_caps_trace,
+                      sizeof(soft_reset_without_caps_trace) / sizeof(soft_reset_without_caps_trace[0])),
+           2000000);
+    assert_replayed();
+
+    TEST_ASSERT_EQUAL(4, ports[0].events.size());
+    TEST_ASSERT_TRUE(ports[0].events[2] == callback_event::power_accepted);
+    TEST_ASSERT_TRUE(ports[0].events[3] == callback_event::power_ready);
+
+    TEST_ASSERT_EQUAL(1, ports[0].hard_reset_times_us.size());
+    TEST_ASSERT_GREATER_OR_EQUAL_UINT32(400300 + 310000, static_cast<uint32_t>(ports[0].hard_reset_times_us[0]));
+    TEST_ASSERT_LESS_OR_EQUAL_UINT32(401500 + 620000, static_cast<uint32_t>(ports[0].hard_reset_times_us[0]));
+}
+
+// A request failing after all retries leads to a soft reset and, without
+// Source_Capabilities after tTypeCSinkWaitCap, to a hard reset
+void test_retry_failure() {
+    replay(load_trace(retry_failure_trace, sizeof(retry_failure_trace) / sizeof(retry_failure_trace[0])), 2000000);
+    assert_replayed();
+
+    TEST_ASSERT_EQUAL(2, ports[0].events.size());
+    TEST_ASSERT_EQUAL(2, ports[0].tx_times_us.size());
+    TEST_ASSERT_EQUAL(1, ports[0].hard_reset_times_us.size());
+    TEST_ASSERT_GREATER_OR_EQUAL_UINT32(155300 + 310000, static_cast<uint32_t>(ports[0].hard_reset_times_us[0]));
+    TEST_ASSERT_LESS_OR_EQUAL_UINT32(155300 + 620000, static_cast<uint32_t>(ports[0].hard_reset_times_us[0]));
+}
+
+// Two PD controllers are handled by independent sinks
+void test_two_ports() {
+    replay(load_trace(two_ports_trace, sizeof(two_ports_trace) / sizeof(two_ports_trace[0])));
+    TEST_ASSERT_EQUAL(2, num_ports);
+    assert_replayed();
+
+    TEST_ASSERT_EQUAL(0, strcmp("FUSB302B__X B_revB", ports[0].sink->device_id()));
+    TEST_ASSERT_EQUAL(0, strcmp("FUSB302B01MPX B_revB", ports[1].sink->device_id()));
+
+    TEST_ASSERT_EQUAL(4, ports[0].events.size());
+    TEST_ASSERT_TRUE(ports[0].events[3] == callback_event::power_ready);
+    TEST_ASSERT_EQUAL(9000, ports[0].sink->active_voltage);
+
+    TEST_ASSERT_EQUAL(3, ports[1].events.size());
+    TEST_ASSERT_TRUE(ports[1].events[2] == callback_event::power_rejected);
+    TEST_ASSERT_EQUAL(5000, ports[1].sink->active_voltage);
+}
+
+// Retries against a source without USB PD do not report a detach and a new attach
+void test_non_pd_source() {
+    replay(load_trace(non_pd_source_trace, sizeof(non_pd_source_trace) / sizeof(non_pd_source_trace[0])), 1000000,
+           true);
+    assert_replayed();
+
+    TEST_ASSERT_EQUAL(1, count_ctrl_events(0, event_kind::attached));
+    TEST_ASSERT_EQUAL(0, count_ctrl_events(0, event_kind::detached));
+    TEST_ASSERT_TRUE(ports[0].ctrl->connection() == typec_state::attached);
+    TEST_ASSERT_EQUAL(1, ports[0].ctrl->retry_stats().retries);
+}
+
+// A source removed during the retry wait is reported as detached once
+void test_removed_non_pd_source() {
+    replay(load_trace(removed_non_pd_source_trace,
+                      sizeof(removed_non_pd_source_trace) / sizeof(removed_non_pd_source_trace[0])),
+           700000, true);
+    assert_replayed();
+
+    TEST_ASSERT_EQUAL(1, count_ctrl_events(0, event_kind::attached));
+    TEST_ASSERT_EQUAL(1, count_ctrl_events(0, event_kind::detached));
+    TEST_ASSERT_TRUE(ports[0].ctrl_events.back() == event_kind::detached);
+}
+
+// Frames with an invalid token are counted (with and without PD_ISR_RX)
+void test_invalid_token() {
+    replay(load_trace(invalid_token_trace, sizeof(invalid_token_trace) / sizeof(invalid_token_trace[0])), 200000,
+           true);
+    assert_replayed();
+
+    fusb302_rx_stats stats = ports[0].ctrl->rx_stats();
+    TEST_ASSERT_EQUAL(1, stats.invalid_messages);
+    TEST_ASSERT_EQUAL(0, stats.messages);
+}
+
+// Captured debug output is loaded from a file, skipping other output and extending the time
+void test_captured_log() {
+    FILE* file = tmpfile();
+    TEST_ASSERT_NOT_NULL(file);
+    fputs(captured_log, file);
+    rewind(file);
+    trace t = load_trace(file);
+    fclose(file);
+
+    TEST_ASSERT_TRUE(t.error.empty());
+    TEST_ASSERT_EQUAL(11, t.entries.size());
+    TEST_ASSERT_EQUAL(0x100000004ull, t.entries[3].time);
+
+    replay(std::move(t));
+    assert_replayed();
+    TEST_ASSERT_EQUAL(1, ports[0].tx_times_us.size());
+}
+
+// Malformed lines and lost accesses are reported
+void test_incomplete_log() {
+    static const char* const lines[] = {"@10050 0:R02 0320", "@10100 0:R01 9", "@20000 lost 3"};
+    trace t = load_trace(lines, 3);
+    TEST_ASSERT_EQUAL(1, t.entries.size());
+    TEST_ASSERT_FALSE(t.error.empty());
+    TEST_ASSERT_EQUAL(3, t.lost);
+}
+
+// Replays a captured log given on the command line (`-` for stdin)
+static const char* log_file_name;
+
+static void test_log_file() {
+    FILE* file = strcmp(log_file_name, "-") == 0 ? stdin : fopen(log_file_name, "r");
+    TEST_ASSERT_NOT_NULL(file);
+    trace t = load_trace(file);
+    if (file != stdin)
+        fclose(file);
+
+    char line[120];
+    snprintf(line, sizeof(line), "%s: %u accesses", log_file_name, static_cast<unsigned>(t.entries.size()));
+    TEST_MESSAGE(line);
+    if (!t.error.empty())
+        TEST_MESSAGE(t.error.c_str());
+    TEST_ASSERT_TRUE_MESSAGE(t.error.empty(), "log contains malformed lines");
+    TEST_ASSERT_TRUE_MESSAGE(t.lost == 0, "recorder lost accesses, log cannot be replayed");
+    TEST_ASSERT_TRUE_MESSAGE(!t.entries.empty(), "log contains no recorded accesses");
+
+    replay(std::move(t));
+    assert_replayed();
+}
+
+int main(int argc, char** argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_wait_then_accept);
+    RUN_TEST(test_reject);
+    RUN_TEST(test_tx_failure);
+    RUN_TEST(test_soft_reset_without_caps);
+    RUN_TEST(test_retry_failure);
+    RUN_TEST(test_two_ports);
+    RUN_TEST(test_non_pd_source);
+    RUN_TEST(test_removed_non_pd_source);
+    RUN_TEST(test_invalid_token);
+    RUN_TEST(test_captured_log);
+    RUN_TEST(test_incomplete_log);
+    for (int i = 1; i < argc; i++) {
+        log_file_name = argv[i];
+        RUN_TEST(test_log_file);
+    }
+    return UNITY_END();
+}